@@ -0,0 +1,4794 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
+#include <pwd.h>
+#include <grp.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdatomic.h>
+#include <sys/vfs.h>
+#include <sys/xattr.h>
+#include <linux/magic.h>
+
+// ---------------- CONFIG -----------------
+#define DEFAULT_TERM_WIDTH 80
+#define DEFAULT_TERM_HEIGHT 24
+#define SPACING 2
+
+// ANSI colors
+#define COLOR_BLUE     "\033[0;34m"
+#define COLOR_GREEN    "\033[0;32m"
+#define COLOR_RED      "\033[0;31m"
+#define COLOR_MAGENTA  "\033[0;35m"
+#define COLOR_RESET    "\033[0m"
+#define COLOR_REVERSE  "\033[7m"
+#define COLOR_ORPHAN   "\033[1;31m"    // symlink whose target is missing
+
+#define OUTBUF_SIZE (64 * 1024)
+#define WATCH_SETTLE_MS 100     // --watch: gather events for this long before redrawing
+#define DEFAULT_STAT_TIMEOUT_MS 5000   // -l: per-entry stat deadline
+#define STAT_MAX_HUNG 64        // stop replacing hung stat workers past this many
+#define ROW_BATCH_ROWS 256      // xattrs, readlink: split larger directories across threads
+#define XATTR_MAX_DEVS 16       // filesystems remembered as having no xattr support
+#define COUNT_BUF_SIZE (256 * 1024)   // --count: getdents64 buffer per directory level
+#define DEFAULT_ESTIMATE_MS 1000      // --estimate: time budget per operand
+#define OPERAND_BUFFER_MAX (16 << 20) // bytes held for operands listed ahead of their turn
+
+// ---------------- OPTIONS -----------------
+// Glob patterns are classified once when parsed so that the common
+// shapes ("name", "*.o", "tmp*") are matched without calling fnmatch.
+enum filter_kind {
+    FILTER_LITERAL,
+    FILTER_PREFIX,
+    FILTER_SUFFIX,
+    FILTER_GLOB,
+    FILTER_REGEX
+};
+
+struct name_filter {
+    enum filter_kind kind;
+    const char *pattern;
+    size_t len;          // length of the fixed part for literal/prefix/suffix
+    regex_t re;
+};
+
+struct filter_list {
+    struct name_filter *items;
+    int count;
+};
+
+enum {
+    HIDDEN_SKIP,         // default: skip names starting with '.'
+    HIDDEN_ALMOST_ALL,   // -A: everything except "." and ".."
+    HIDDEN_ALL           // -a
+};
+
+// Metadata predicates (--type, --larger-than, --newer-than, --older-than,
+// --owner). Each one names the statx fields it needs, see predicate_mask().
+struct predicates {
+    unsigned int type_mask;      // bit (1 << DT_xxx) per accepted type, 0 = any
+    int has_min_size;
+    off_t min_size;              // --larger-than: st_size > min_size
+    time_t newer_than;           // mtime cutoffs, 0 = unset
+    time_t older_than;
+    int has_owner;
+    uid_t owner;
+};
+
+enum {
+    FORMAT_TEXT,
+    FORMAT_JSON,         // one array of entry objects
+    FORMAT_NDJSON,       // one entry object per line
+    FORMAT_BIN           // mmap-able snapshot, see SNAPSHOT below
+};
+
+struct entry_table;
+struct layout;
+struct ls_options;
+
+// The routines that write names and lay out a directory are picked once
+// per run by choose_renderer(), so the per-entry loops do not test the
+// output flags.
+typedef void (*name_fn)(const struct entry_table *t, int i);
+typedef void (*render_fn)(const struct entry_table *t, size_t longest,
+                          const struct ls_options *opts, const struct layout *lay);
+typedef void (*long_fn)(const struct entry_table *t, const int *rows, int n,
+                        const struct ls_options *opts, const struct layout *lay);
+
+struct ls_options {
+    int long_format;
+    int horizontal_flag;
+    int one_per_line;            // -1
+    int recursive_flag;
+    int show_hidden;
+    int unsorted;                // -U: directory order, entries streamed when possible
+    int format;
+    int use_cache;               // --cache: reuse tables saved by an earlier run
+    int threads;                 // --threads: worker threads, 0 = one per CPU
+    int first_screen;            // -l on a terminal: show the first screenful early
+    int human_sizes;             // -h
+    int show_inode;              // -i
+    int show_blocks;             // -s
+    int show_context;            // -Z: security context column
+    int show_acl;                // --acl: '+' after the permissions of files with an ACL
+    int summarize;               // -R --summarize: du-style totals per directory
+    int tree;                    // -T: tree view, implies -R
+    long page_limit;             // --limit, 0 = no limit
+    long page_offset;            // --offset
+    const char *page_after;      // --after: list only names sorting after this
+    int color;                   // --color, already resolved against isatty
+    int follow_operands;         // -H or -L: symlink operands are followed even with -l
+    name_fn print_name;
+    render_fn render;
+    long_fn render_rows;         // -l rows, for render_long and the first screen
+    int max_depth;               // -1 = no limit; root directory is depth 0
+    struct filter_list prune;    // --prune: never descend into these
+    struct filter_list ignore;   // --ignore / --ignore-regex
+    struct filter_list include;  // --include / --include-regex
+    struct predicates pred;
+};
+
+// A directory's entries as parallel arrays, one per field, so that
+// sorting, width computation and filtering each walk only the columns
+// they read. Names are packed into one arena. Metadata is filled lazily:
+// stat_mask[i] records which STATX_* fields of row i are valid, and a
+// metadata column is only allocated once some row needs it, so a plain
+// listing costs a few bytes per entry beyond its name.
+#define ENTRY_MATCHED 0x1        // passed the metadata predicates
+#define ENTRY_STALE   0x2        // stat missed its deadline; shown with "?" fields
+#define ENTRY_ACL     0x4        // has a POSIX ACL beyond its mode bits
+#define ENTRY_LABEL   0x8        // has a security context
+#define ENTRY_XATTRS  0x10       // the two bits above (and label) are valid
+#define ENTRY_TARGET  0x20       // symlink; target_off is valid
+#define ENTRY_DANGLING 0x40      // symlink whose target does not resolve
+
+struct entry_table {
+    int count;
+    int capacity;
+    char *names;                 // NUL-terminated names, back to back
+    size_t names_len;
+    size_t names_cap;
+    size_t names_dead;           // bytes of names no row points at
+    char *targets;               // -l: symlink targets, NUL-terminated
+    size_t targets_len;
+    uint32_t *name_off;
+    uint16_t *name_len;
+    unsigned char *d_type;       // from readdir, DT_UNKNOWN if not reported
+    unsigned char *flags;
+    uint32_t *stat_mask;
+    // NULL until first filled
+    uint32_t *mode;
+    uint32_t *nlink;
+    uint32_t *uid;
+    uint32_t *gid;
+    int64_t *size;
+    int64_t *blocks;
+    uint64_t *ino;
+    uint64_t *dev;
+    int64_t *atime;
+    int64_t *mtime;
+    int64_t *ctime;
+    const char **label;          // -Z: interned, shared by every table
+    uint32_t *target_off;        // into targets
+    int saved;                   // rows read from a snapshot or cache file, not the tree
+};
+
+// Buffered writer for all listing output; bypasses stdio so records are
+// copied straight into one large buffer. With fd < 0 the buffer grows
+// instead of being flushed (used to build --serve replies). Each thread
+// has its own.
+struct outbuf {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+    long records;        // entries written, for JSON separators
+    size_t flushed;      // bytes written to fd so far
+};
+
+static _Thread_local struct outbuf out = { .fd = STDOUT_FILENO };
+
+// ---------------- OUTPUT -----------------
+// --timing: when the run started and when its first byte was written
+static struct timespec time_start, time_first_byte;
+
+void out_flush(struct outbuf *ob) {
+    if (ob->fd < 0) return;
+    if (ob->len > 0 && ob->fd == STDOUT_FILENO && time_first_byte.tv_sec == 0)
+        clock_gettime(CLOCK_MONOTONIC, &time_first_byte);
+    size_t off = 0;
+    while (off < ob->len) {
+        ssize_t n = write(ob->fd, ob->buf + off, ob->len - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("write");
+            break;
+        }
+        off += n;
+    }
+    ob->flushed += off;
+    ob->len = 0;
+}
+
+void out_write(struct outbuf *ob, const char *data, size_t n) {
+    if (!ob->buf) {
+        ob->buf = malloc(OUTBUF_SIZE);
+        if (!ob->buf) { perror("malloc"); exit(EXIT_FAILURE); }
+        ob->cap = OUTBUF_SIZE;
+    }
+    if (ob->fd < 0 && ob->len + n > ob->cap) {
+        size_t cap = ob->cap;
+        while (cap < ob->len + n) cap *= 2;
+        char *grown = realloc(ob->buf, cap);
+        if (!grown) { perror("realloc"); exit(EXIT_FAILURE); }
+        ob->buf = grown;
+        ob->cap = cap;
+    }
+    if (ob->len + n > ob->cap) {
+        out_flush(ob);
+        if (n > ob->cap) {
+            ob->len = n;
+            char *saved = ob->buf;
+            ob->buf = (char *)data;
+            out_flush(ob);
+            ob->buf = saved;
+            return;
+        }
+    }
+    memcpy(ob->buf + ob->len, data, n);
+    ob->len += n;
+}
+
+void out_str(struct outbuf *ob, const char *s) {
+    out_write(ob, s, strlen(s));
+}
+
+void out_printf(struct outbuf *ob, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+void out_printf(struct outbuf *ob, const char *fmt, ...) {
+    char tmp[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n < sizeof(tmp)) { out_write(ob, tmp, n); return; }
+
+    char *big = malloc(n + 1);
+    if (!big) return;
+    va_start(ap, fmt);
+    vsnprintf(big, n + 1, fmt, ap);
+    va_end(ap);
+    out_write(ob, big, n);
+    free(big);
+}
+
+void out_i64(struct outbuf *ob, long long v) {
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long long u = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+    do { *--p = '0' + u % 10; u /= 10; } while (u);
+    if (v < 0) *--p = '-';
+    out_write(ob, p, tmp + sizeof(tmp) - p);
+}
+
+// ---------------- HELPERS -----------------
+int get_terminal_width() {
+    struct winsize w;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0 && w.ws_col > 0)
+        return w.ws_col;
+    return DEFAULT_TERM_WIDTH;
+}
+
+int get_terminal_height() {
+    struct winsize w;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0 && w.ws_row > 0)
+        return w.ws_row;
+    return DEFAULT_TERM_HEIGHT;
+}
+
+double elapsed_ms(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+// The path of name inside dir. File operands are listed from "." under
+// their own, possibly absolute, names, which are used as they are.
+void join_path(char *buf, size_t size, const char *dir, const char *name) {
+    if (name[0] == '/') snprintf(buf, size, "%s", name);
+    else snprintf(buf, size, "%s/%s", dir, name);
+}
+
+int thread_count(const struct ls_options *opts) {
+    if (opts->threads > 0) return opts->threads;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+// marker follows the permission bits when not '\0': '+' for an ACL,
+// '.' for a security context only, ' ' to keep the column aligned.
+// "drwxr-xr-x" and the marker (or '\0') into perms[12].
+void format_permissions(mode_t mode, char marker, char *perms) {
+    perms[0] = S_ISDIR(mode) ? 'd' :
+               S_ISLNK(mode) ? 'l' :
+               S_ISCHR(mode) ? 'c' :
+               S_ISBLK(mode) ? 'b' :
+               S_ISSOCK(mode) ? 's' :
+               S_ISFIFO(mode) ? 'p' : '-';
+    perms[1] = (mode & S_IRUSR) ? 'r' : '-';
+    perms[2] = (mode & S_IWUSR) ? 'w' : '-';
+    perms[3] = (mode & S_IXUSR) ? 'x' : '-';
+    perms[4] = (mode & S_IRGRP) ? 'r' : '-';
+    perms[5] = (mode & S_IWGRP) ? 'w' : '-';
+    perms[6] = (mode & S_IXGRP) ? 'x' : '-';
+    perms[7] = (mode & S_IROTH) ? 'r' : '-';
+    perms[8] = (mode & S_IWOTH) ? 'w' : '-';
+    perms[9] = (mode & S_IXOTH) ? 'x' : '-';
+    perms[10] = marker;
+    perms[11] = '\0';
+}
+
+void print_permissions(mode_t mode, char marker) {
+    char perms[12];
+    format_permissions(mode, marker, perms);
+    out_printf(&out, "%s ", perms);
+}
+
+// n spaces.
+void out_pad(struct outbuf *ob, int n) {
+    static const char spaces[] = "                                ";
+    for (; n > 0; n -= 32) out_write(ob, spaces, n < 32 ? n : 32);
+}
+
+// v right-aligned in width columns.
+void out_number(struct outbuf *ob, unsigned long long v, int width) {
+    char buf[24];
+    int n = 0;
+    do { buf[sizeof(buf) - ++n] = '0' + v % 10; v /= 10; } while (v);
+    out_pad(ob, width - n);
+    out_write(ob, buf + sizeof(buf) - n, n);
+}
+
+void print_colored(const char *name, mode_t mode) {
+    if (S_ISDIR(mode)) out_printf(&out, COLOR_BLUE "%s" COLOR_RESET, name);
+    else if (S_ISLNK(mode)) out_printf(&out, COLOR_MAGENTA "%s" COLOR_RESET, name);
+    else if (mode & S_IXUSR) out_printf(&out, COLOR_GREEN "%s" COLOR_RESET, name);
+    else if (strstr(name, ".tar") || strstr(name, ".gz") || strstr(name, ".zip"))
+        out_printf(&out, COLOR_RED "%s" COLOR_RESET, name);
+    else if (S_ISCHR(mode) || S_ISBLK(mode) || S_ISSOCK(mode) || S_ISFIFO(mode))
+        out_printf(&out, COLOR_REVERSE "%s" COLOR_RESET, name);
+    else
+        out_str(&out, name);
+}
+
+// ---------------- ENTRY TABLE -----------------
+struct column {
+    void **data;
+    size_t width;
+};
+
+#define TABLE_COLUMNS 18
+#define TABLE_BASE_COLUMNS 5     // allocated with the table; the rest on first use
+
+// Every column of t, base columns first. Lazy ones may still be NULL.
+void table_columns(struct entry_table *t, struct column *cols) {
+    struct column all[TABLE_COLUMNS] = {
+        { (void **)&t->name_off,  sizeof(*t->name_off) },
+        { (void **)&t->name_len,  sizeof(*t->name_len) },
+        { (void **)&t->d_type,    sizeof(*t->d_type) },
+        { (void **)&t->flags,     sizeof(*t->flags) },
+        { (void **)&t->stat_mask, sizeof(*t->stat_mask) },
+        { (void **)&t->mode,      sizeof(*t->mode) },
+        { (void **)&t->nlink,     sizeof(*t->nlink) },
+        { (void **)&t->uid,       sizeof(*t->uid) },
+        { (void **)&t->gid,       sizeof(*t->gid) },
+        { (void **)&t->size,      sizeof(*t->size) },
+        { (void **)&t->blocks,    sizeof(*t->blocks) },
+        { (void **)&t->ino,       sizeof(*t->ino) },
+        { (void **)&t->dev,       sizeof(*t->dev) },
+        { (void **)&t->atime,     sizeof(*t->atime) },
+        { (void **)&t->mtime,     sizeof(*t->mtime) },
+        { (void **)&t->ctime,     sizeof(*t->ctime) },
+        { (void **)&t->label,     sizeof(*t->label) },
+        { (void **)&t->target_off, sizeof(*t->target_off) },
+    };
+    memcpy(cols, all, sizeof(all));
+}
+
+// --timing: rows and bytes of every table freed so far.
+static _Atomic long table_rows_seen, table_bytes_seen;
+
+// Bytes the rows of t occupy in its allocated columns and name arena.
+size_t table_bytes(struct entry_table *t) {
+    struct column cols[TABLE_COLUMNS];
+    table_columns(t, cols);
+    size_t bytes = t->names_len - t->names_dead + t->targets_len;
+    for (int c = 0; c < TABLE_COLUMNS; c++)
+        if (*cols[c].data) bytes += t->count * cols[c].width;
+    return bytes;
+}
+
+void table_free(struct entry_table *t) {
+    table_rows_seen += t->count;
+    table_bytes_seen += table_bytes(t);
+    struct column cols[TABLE_COLUMNS];
+    table_columns(t, cols);
+    for (int c = 0; c < TABLE_COLUMNS; c++) free(*cols[c].data);
+    free(t->names);
+    free(t->targets);
+    memset(t, 0, sizeof(*t));
+}
+
+// Empties t but keeps its allocations, for a scratch table reused per entry.
+void table_reset(struct entry_table *t) {
+    t->count = 0;
+    t->names_len = 0;
+    t->names_dead = 0;
+}
+
+int table_grow(struct entry_table *t, int capacity) {
+    struct column cols[TABLE_COLUMNS];
+    table_columns(t, cols);
+    for (int c = 0; c < TABLE_COLUMNS; c++) {
+        if (c >= TABLE_BASE_COLUMNS && !*cols[c].data) continue;
+        void *grown = realloc(*cols[c].data, (size_t)capacity * cols[c].width);
+        if (!grown) { perror("realloc"); return -1; }
+        *cols[c].data = grown;
+    }
+    t->capacity = capacity;
+    return 0;
+}
+
+// Allocates a lazy column the first time a row needs it.
+int table_need(struct entry_table *t, void **col, size_t width) {
+    if (*col) return 0;
+    *col = calloc(t->capacity ? t->capacity : 1, width);
+    if (!*col) { perror("calloc"); return -1; }
+    return 0;
+}
+
+// Rewrites the arena without the names of removed rows.
+void table_pack_names(struct entry_table *t) {
+    char *packed = malloc(t->names_cap);
+    if (!packed) return;
+    size_t len = 0;
+    for (int i = 0; i < t->count; i++) {
+        memcpy(packed + len, t->names + t->name_off[i], t->name_len[i] + 1);
+        t->name_off[i] = len;
+        len += t->name_len[i] + 1;
+    }
+    free(t->names);
+    t->names = packed;
+    t->names_len = len;
+    t->names_dead = 0;
+}
+
+// Copies name to the end of the arena; returns its offset, or -1.
+long table_store_name(struct entry_table *t, const char *name, size_t len) {
+    if (t->names_len + len + 1 > t->names_cap) {
+        if (t->names_dead > t->names_len / 2) table_pack_names(t);
+        size_t cap = t->names_cap ? t->names_cap : 256;
+        while (t->names_len + len + 1 > cap) cap *= 2;
+        if (cap != t->names_cap) {
+            char *grown = realloc(t->names, cap);
+            if (!grown) { perror("realloc"); return -1; }
+            t->names = grown;
+            t->names_cap = cap;
+        }
+    }
+    long off = t->names_len;
+    memcpy(t->names + off, name, len);
+    t->names[off + len] = '\0';
+    t->names_len += len + 1;
+    return off;
+}
+
+// Appends a row with no metadata; returns its index, or -1.
+int table_add(struct entry_table *t, const char *name, size_t len, unsigned char d_type) {
+    if (t->count == t->capacity && table_grow(t, t->capacity ? t->capacity * 2 : 16) == -1)
+        return -1;
+    long off = table_store_name(t, name, len);
+    if (off == -1) return -1;
+    int i = t->count++;
+    t->name_off[i] = off;
+    t->name_len[i] = len;
+    t->d_type[i] = d_type;
+    t->flags[i] = 0;
+    t->stat_mask[i] = 0;
+    return i;
+}
+
+// Gives row i a new name and no metadata. The old name's bytes are
+// reclaimed when the arena is next packed.
+int table_replace(struct entry_table *t, int i, const char *name, size_t len, unsigned char d_type) {
+    long off = table_store_name(t, name, len);
+    if (off == -1) return -1;
+    t->names_dead += t->name_len[i] + 1;
+    t->name_off[i] = off;
+    t->name_len[i] = len;
+    t->d_type[i] = d_type;
+    t->flags[i] = 0;
+    t->stat_mask[i] = 0;
+    return 0;
+}
+
+// Gives row i the symlink target s, appended to the table's arena.
+int table_set_target(struct entry_table *t, int i, const char *s) {
+    size_t len = strlen(s) + 1;
+    if (table_need(t, (void **)&t->target_off, sizeof(*t->target_off)) == -1) return -1;
+    char *grown = realloc(t->targets, t->targets_len + len);
+    if (!grown) { perror("realloc"); return -1; }
+    t->targets = grown;
+    memcpy(t->targets + t->targets_len, s, len);
+    t->target_off[i] = t->targets_len;
+    t->targets_len += len;
+    t->flags[i] |= ENTRY_TARGET;
+    return 0;
+}
+
+// Drops the row just added.
+void table_pop(struct entry_table *t) {
+    t->count--;
+    t->names_len -= t->name_len[t->count] + 1;
+}
+
+const char *entry_name(const struct entry_table *t, int i) {
+    return t->names + t->name_off[i];
+}
+
+// Overwrites row to with row from (the name is shared, not copied).
+void table_copy_row(struct entry_table *t, int from, int to) {
+    if (from == to) return;
+    if (t->name_off[to] != t->name_off[from]) t->names_dead += t->name_len[to] + 1;
+    struct column cols[TABLE_COLUMNS];
+    table_columns(t, cols);
+    for (int c = 0; c < TABLE_COLUMNS; c++) {
+        char *col = *cols[c].data;
+        if (col) memcpy(col + to * cols[c].width, col + from * cols[c].width, cols[c].width);
+    }
+}
+
+// Moves row from to position to, shifting the rows in between.
+void table_move(struct entry_table *t, int from, int to) {
+    if (from == to) return;
+    struct column cols[TABLE_COLUMNS];
+    table_columns(t, cols);
+    for (int c = 0; c < TABLE_COLUMNS; c++) {
+        char *col = *cols[c].data;
+        size_t w = cols[c].width;
+        if (!col) continue;
+        char saved[8];
+        memcpy(saved, col + from * w, w);
+        if (from < to) memmove(col + from * w, col + (from + 1) * w, (to - from) * w);
+        else memmove(col + (to + 1) * w, col + to * w, (from - to) * w);
+        memcpy(col + to * w, saved, w);
+    }
+}
+
+void table_remove(struct entry_table *t, int i) {
+    t->names_dead += t->name_len[i] + 1;
+    table_move(t, i, t->count - 1);
+    t->count--;
+}
+
+// dst[k] = src[order[k]] for one column.
+void gather_column(void *dst, const void *src, size_t width, const int *order, int n) {
+    switch (width) {
+        case 1: for (int k = 0; k < n; k++) ((uint8_t *)dst)[k] = ((const uint8_t *)src)[order[k]]; break;
+        case 2: for (int k = 0; k < n; k++) ((uint16_t *)dst)[k] = ((const uint16_t *)src)[order[k]]; break;
+        case 4: for (int k = 0; k < n; k++) ((uint32_t *)dst)[k] = ((const uint32_t *)src)[order[k]]; break;
+        default: for (int k = 0; k < n; k++) ((uint64_t *)dst)[k] = ((const uint64_t *)src)[order[k]]; break;
+    }
+}
+
+// Rows order[0..n) of src as a new table with its own, packed names.
+// order == NULL copies the first n rows.
+int table_copy(const struct entry_table *src, const int *order, int n, struct entry_table *dst) {
+    memset(dst, 0, sizeof(*dst));
+    int *all = NULL;
+    if (!order) {
+        all = malloc((n ? n : 1) * sizeof(*all));
+        if (!all) { perror("malloc"); return -1; }
+        for (int k = 0; k < n; k++) all[k] = k;
+        order = all;
+    }
+    size_t names = 0;
+    for (int k = 0; k < n; k++) names += src->name_len[order[k]] + 1;
+    dst->names = malloc(names ? names : 1);
+    if (!dst->names || table_grow(dst, n ? n : 1) == -1) { free(all); table_free(dst); return -1; }
+    dst->names_cap = names ? names : 1;
+
+    struct column from[TABLE_COLUMNS], to[TABLE_COLUMNS];
+    table_columns((struct entry_table *)src, from);
+    table_columns(dst, to);
+    for (int c = 1; c < TABLE_COLUMNS; c++) {
+        if (!*from[c].data) continue;
+        if (table_need(dst, to[c].data, to[c].width) == -1) { free(all); table_free(dst); return -1; }
+        gather_column(*to[c].data, *from[c].data, from[c].width, order, n);
+    }
+    for (int k = 0; k < n; k++) {
+        memcpy(dst->names + dst->names_len, entry_name(src, order[k]), src->name_len[order[k]] + 1);
+        dst->name_off[k] = dst->names_len;
+        dst->names_len += src->name_len[order[k]] + 1;
+    }
+    // Symlink targets keep their offsets; the arena is copied whole.
+    if (src->targets_len) {
+        dst->targets = malloc(src->targets_len);
+        if (!dst->targets) { perror("malloc"); free(all); table_free(dst); return -1; }
+        memcpy(dst->targets, src->targets, src->targets_len);
+        dst->targets_len = src->targets_len;
+    }
+    dst->count = n;
+    dst->saved = src->saved;
+    free(all);
+    return 0;
+}
+
+// Reorders every column so that row k becomes the old row order[k].
+int table_permute(struct entry_table *t, const int *order) {
+    struct column cols[TABLE_COLUMNS];
+    table_columns(t, cols);
+    void *tmp = malloc((t->count ? t->count : 1) * sizeof(uint64_t));
+    if (!tmp) { perror("malloc"); return -1; }
+    for (int c = 0; c < TABLE_COLUMNS; c++) {
+        if (!*cols[c].data) continue;
+        gather_column(tmp, *cols[c].data, cols[c].width, order, t->count);
+        memcpy(*cols[c].data, tmp, t->count * cols[c].width);
+    }
+    free(tmp);
+    return 0;
+}
+
+// Sorting reads only the name columns; the order found is then applied
+// to each column in one pass.
+struct sort_key {
+    const char *name;
+    int row;
+};
+
+int compare_keys(const void *a, const void *b) {
+    return strcmp(((const struct sort_key *)a)->name, ((const struct sort_key *)b)->name);
+}
+
+void table_sort(struct entry_table *t) {
+    if (t->count < 2) return;
+    struct sort_key *keys = malloc(t->count * sizeof(*keys));
+    int *order = malloc(t->count * sizeof(*order));
+    if (!keys || !order) { perror("malloc"); free(keys); free(order); return; }
+    for (int i = 0; i < t->count; i++) keys[i] = (struct sort_key){ entry_name(t, i), i };
+    qsort(keys, t->count, sizeof(*keys), compare_keys);
+    for (int i = 0; i < t->count; i++) order[i] = keys[i].row;
+    table_permute(t, order);
+    free(keys);
+    free(order);
+}
+
+// ---------------- NAME FILTERS -----------------
+int add_filter(struct filter_list *list, const char *pattern, int is_regex) {
+    struct name_filter *items = realloc(list->items, (list->count + 1) * sizeof(*items));
+    if (!items) { perror("realloc"); return -1; }
+    list->items = items;
+
+    struct name_filter *f = &items[list->count];
+    memset(f, 0, sizeof(*f));
+    f->pattern = pattern;
+
+    if (is_regex) {
+        int rc = regcomp(&f->re, pattern, REG_EXTENDED | REG_NOSUB);
+        if (rc != 0) {
+            char msg[256];
+            regerror(rc, &f->re, msg, sizeof(msg));
+            fprintf(stderr, "invalid regex '%s': %s\n", pattern, msg);
+            return -1;
+        }
+        f->kind = FILTER_REGEX;
+    } else {
+        size_t len = strlen(pattern);
+        size_t meta = strcspn(pattern, "*?[\\");
+        if (meta == len) {
+            f->kind = FILTER_LITERAL;
+            f->len = len;
+        } else if (pattern[0] == '*' && strcspn(pattern + 1, "*?[\\") == len - 1) {
+            f->kind = FILTER_SUFFIX;
+            f->pattern = pattern + 1;
+            f->len = len - 1;
+        } else if (meta == len - 1 && pattern[meta] == '*') {
+            f->kind = FILTER_PREFIX;
+            f->len = meta;
+        } else {
+            f->kind = FILTER_GLOB;
+        }
+    }
+    list->count++;
+    return 0;
+}
+
+int filter_matches(const struct name_filter *f, const char *name, size_t len) {
+    switch (f->kind) {
+        case FILTER_LITERAL:
+            return len == f->len && memcmp(name, f->pattern, len) == 0;
+        case FILTER_PREFIX:
+            return len >= f->len && memcmp(name, f->pattern, f->len) == 0;
+        case FILTER_SUFFIX:
+            return len >= f->len && memcmp(name + len - f->len, f->pattern, f->len) == 0;
+        case FILTER_GLOB:
+            return fnmatch(f->pattern, name, 0) == 0;
+        case FILTER_REGEX:
+            return regexec(&f->re, name, 0, NULL, 0) == 0;
+    }
+    return 0;
+}
+
+int list_matches(const struct filter_list *list, const char *name, size_t len) {
+    for (int i = 0; i < list->count; i++)
+        if (filter_matches(&list->items[i], name, len)) return 1;
+    return 0;
+}
+
+void free_filters(struct filter_list *list) {
+    for (int i = 0; i < list->count; i++)
+        if (list->items[i].kind == FILTER_REGEX) regfree(&list->items[i].re);
+    free(list->items);
+    list->items = NULL;
+    list->count = 0;
+}
+
+// Decides on the raw d_name whether an entry is listed at all, so that
+// rejected entries cost nothing beyond reading the directory. Under -R
+// an entry that fails --include is NAME_DESCEND: not shown, but kept in
+// case it is a directory with matches below, as the predicates do.
+enum { NAME_SKIP, NAME_SHOWN, NAME_DESCEND };
+
+int name_wanted(const char *name, size_t len, const struct ls_options *opts) {
+    if (name[0] == '.') {
+        if (opts->show_hidden == HIDDEN_SKIP) return NAME_SKIP;
+        if (opts->show_hidden == HIDDEN_ALMOST_ALL &&
+            (len == 1 || (len == 2 && name[1] == '.'))) return NAME_SKIP;
+    }
+    if (opts->ignore.count && list_matches(&opts->ignore, name, len)) return NAME_SKIP;
+    if (opts->include.count && !list_matches(&opts->include, name, len))
+        return opts->recursive_flag ? NAME_DESCEND : NAME_SKIP;
+    return NAME_SHOWN;
+}
+
+// ---------------- METADATA -----------------
+// -L: entries are stat'ed through symlinks. Set once in main, before any
+// listing starts.
+static int stat_follow;
+
+// Fetches the requested fields of one file with statx, relative to dfd.
+// *got receives the fields that were filled in. Under -L a link whose
+// target is missing is described as the link itself.
+int stat_fetch(int dfd, const char *name, unsigned int mask, struct stat *st, unsigned int *got) {
+    struct statx sx;
+    if ((!stat_follow || statx(dfd, name, 0, mask, &sx) == -1) &&
+        statx(dfd, name, AT_SYMLINK_NOFOLLOW, mask, &sx) == -1)
+        return -1;
+
+    *got = sx.stx_mask & mask;
+    memset(st, 0, sizeof(*st));
+    st->st_mode = sx.stx_mode;
+    st->st_nlink = sx.stx_nlink;
+    st->st_uid = sx.stx_uid;
+    st->st_gid = sx.stx_gid;
+    st->st_atim = (struct timespec){ sx.stx_atime.tv_sec, sx.stx_atime.tv_nsec };
+    st->st_mtim = (struct timespec){ sx.stx_mtime.tv_sec, sx.stx_mtime.tv_nsec };
+    st->st_ctim = (struct timespec){ sx.stx_ctime.tv_sec, sx.stx_ctime.tv_nsec };
+    st->st_ino = sx.stx_ino;
+    st->st_size = sx.stx_size;
+    st->st_blocks = sx.stx_blocks;
+    st->st_dev = makedev(sx.stx_dev_major, sx.stx_dev_minor);
+    return 0;
+}
+
+// Merges the fields of st named by mask into row i, allocating the
+// columns they live in on first use. The device travels with the inode.
+int row_set_stat(struct entry_table *t, int i, const struct stat *st, unsigned int mask) {
+    #define SET_COLUMN(bits, col, value) \
+        if (mask & (bits)) { \
+            if (table_need(t, (void **)&t->col, sizeof(*t->col)) == -1) return -1; \
+            t->col[i] = (value); \
+        }
+    SET_COLUMN(STATX_NLINK, nlink, st->st_nlink);
+    SET_COLUMN(STATX_UID, uid, st->st_uid);
+    SET_COLUMN(STATX_GID, gid, st->st_gid);
+    SET_COLUMN(STATX_SIZE, size, st->st_size);
+    SET_COLUMN(STATX_BLOCKS, blocks, st->st_blocks);
+    SET_COLUMN(STATX_INO, ino, st->st_ino);
+    SET_COLUMN(STATX_INO, dev, st->st_dev);
+    SET_COLUMN(STATX_ATIME, atime, st->st_atime);
+    SET_COLUMN(STATX_MTIME, mtime, st->st_mtime);
+    SET_COLUMN(STATX_CTIME, ctime, st->st_ctime);
+    #undef SET_COLUMN
+
+    // Type and permission bits share the mode column.
+    if (mask & (STATX_TYPE | STATX_MODE)) {
+        if (table_need(t, (void **)&t->mode, sizeof(*t->mode)) == -1) return -1;
+        uint32_t bits = (mask & STATX_TYPE ? S_IFMT : 0) | (mask & STATX_MODE ? ~(uint32_t)S_IFMT : 0);
+        uint32_t old = t->stat_mask[i] & (STATX_TYPE | STATX_MODE) ? t->mode[i] : 0;
+        t->mode[i] = (old & ~bits) | (st->st_mode & bits);
+    }
+    t->stat_mask[i] |= mask;
+    return 0;
+}
+
+// Row i as a struct stat, for the writers that take one; fields not
+// fetched are zero.
+void row_to_stat(const struct entry_table *t, int i, struct stat *st) {
+    unsigned int mask = t->stat_mask[i];
+    memset(st, 0, sizeof(*st));
+    if (mask & (STATX_TYPE | STATX_MODE)) st->st_mode = t->mode[i];
+    if (mask & STATX_NLINK)  st->st_nlink = t->nlink[i];
+    if (mask & STATX_UID)    st->st_uid = t->uid[i];
+    if (mask & STATX_GID)    st->st_gid = t->gid[i];
+    if (mask & STATX_SIZE)   st->st_size = t->size[i];
+    if (mask & STATX_BLOCKS) st->st_blocks = t->blocks[i];
+    if (mask & STATX_INO)    { st->st_ino = t->ino[i]; st->st_dev = t->dev[i]; }
+    if (mask & STATX_ATIME)  st->st_atime = t->atime[i];
+    if (mask & STATX_MTIME)  st->st_mtime = t->mtime[i];
+    if (mask & STATX_CTIME)  st->st_ctime = t->ctime[i];
+}
+
+// Fetches the requested fields of row i, relative to dfd. Fields already
+// cached are not asked again.
+int stat_row_at(int dfd, const char *name, struct entry_table *t, int i, unsigned int mask) {
+    mask |= STATX_TYPE;
+    if ((t->stat_mask[i] & mask) == mask) return 0;
+
+    struct stat st;
+    unsigned int got;
+    if (stat_fetch(dfd, name, mask, &st, &got) == -1) return -1;
+    return row_set_stat(t, i, &st, got);
+}
+
+int stat_row(const char *path, struct entry_table *t, int i, unsigned int mask) {
+    if ((t->stat_mask[i] & (mask | STATX_TYPE)) == (mask | STATX_TYPE)) return 0;
+    char fullpath[1024];
+    join_path(fullpath, sizeof(fullpath), path, entry_name(t, i));
+    return stat_row_at(AT_FDCWD, fullpath, t, i, mask);
+}
+
+// Whether d_type tells the type row i is listed with; under -L a link's
+// d_type says nothing about its target.
+int dtype_known(const struct entry_table *t, int i) {
+    return t->d_type[i] != DT_UNKNOWN && !(stat_follow && t->d_type[i] == DT_LNK);
+}
+
+// File type from d_type when the filesystem reports it, otherwise from
+// a (cached) statx of the type field only. Returns 0 if unknown.
+mode_t row_type(const char *path, struct entry_table *t, int i) {
+    if (t->stat_mask[i] & STATX_TYPE) return t->mode[i] & S_IFMT;
+    if (dtype_known(t, i)) return DTTOIF(t->d_type[i]);
+    if (stat_row(path, t, i, STATX_TYPE) == -1) return 0;
+    return t->mode[i] & S_IFMT;
+}
+
+// Whether -R and -T enter row i. Under -L a symlink to a directory is
+// listed as one but never entered, so link cycles cannot be walked.
+int row_descends(const char *path, struct entry_table *t, int i) {
+    if (!S_ISDIR(row_type(path, t, i))) return 0;
+    if (!stat_follow || t->d_type[i] == DT_DIR) return 1;
+    if (t->d_type[i] == DT_LNK) return 0;
+
+    char fullpath[1024];
+    struct stat st;
+    join_path(fullpath, sizeof(fullpath), path, entry_name(t, i));
+    return lstat(fullpath, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// statx fields needed to evaluate the active predicates, 0 if none.
+unsigned int predicate_mask(const struct predicates *p) {
+    unsigned int mask = 0;
+    if (p->type_mask) mask |= STATX_TYPE;
+    if (p->has_min_size) mask |= STATX_SIZE;
+    if (p->newer_than || p->older_than) mask |= STATX_MTIME;
+    if (p->has_owner) mask |= STATX_UID;
+    return mask;
+}
+
+int row_matches(int dfd, struct entry_table *t, int i, const struct predicates *p, unsigned int mask) {
+    if (mask == 0) return 1;
+
+    // d_type alone can reject an entry, or accept it when type is the
+    // only predicate; either way no stat is needed.
+    if (p->type_mask && dtype_known(t, i)) {
+        if (!(p->type_mask & (1u << t->d_type[i]))) return 0;
+        if (mask == STATX_TYPE) return 1;
+    }
+    if (stat_row_at(dfd, entry_name(t, i), t, i, mask) == -1) return 0;
+
+    if (p->type_mask && !(p->type_mask & (1u << IFTODT(t->mode[i])))) return 0;
+    if (p->has_min_size && t->size[i] <= p->min_size) return 0;
+    if (p->newer_than && t->mtime[i] < p->newer_than) return 0;
+    if (p->older_than && t->mtime[i] >= p->older_than) return 0;
+    if (p->has_owner && t->uid[i] != p->owner) return 0;
+    return 1;
+}
+
+// ---------------- STAT POOL -----------------
+// Long listings stat their entries on a shared pool of worker threads so
+// that one entry on a hung network mount cannot stall the rest. Each
+// entry gets a deadline; one that misses it is shown with "?" fields
+// while its worker is left to finish in the background.
+enum slot_state {
+    SLOT_QUEUED,
+    SLOT_RUNNING,
+    SLOT_DONE,
+    SLOT_FAILED,
+    SLOT_TIMED_OUT,      // caller gave up while a worker was in statx
+    SLOT_ABANDONED       // caller gave up before any worker picked it up
+};
+
+struct stat_slot {
+    int index;                   // row in the caller's table
+    const char *name;            // points into the job's name copies
+    enum slot_state state;
+    struct timespec started;
+    unsigned int mask;
+    struct stat st;
+};
+
+// One directory's stat phase. Workers that hang in statx keep the job
+// alive after the caller has moved on, so it owns copies of the path
+// and names and is freed by whoever drops the last reference.
+struct stat_job {
+    struct stat_job *next;
+    const char *path;
+    struct stat_slot *slots;
+    int count;
+    unsigned int mask;           // statx fields wanted
+    int next_slot;               // next slot to hand to a worker
+    int waiting;                 // slot the caller is blocked on, -1 if none
+    int refs;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;         // a job was queued
+    pthread_cond_t done;         // a slot finished (monotonic clock)
+    struct stat_job *jobs;       // jobs with slots not yet handed out
+    int workers;
+    int hung;                    // workers stuck in a timed-out statx
+    int target;                  // workers wanted when none are hung
+} stat_pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER };
+
+static pthread_once_t stat_pool_once = PTHREAD_ONCE_INIT;
+static int stat_timeout_ms = DEFAULT_STAT_TIMEOUT_MS;  // --stat-timeout, 0 = stat inline
+
+// Test hook: LS_STAT_DELAY=PATTERN:MS sleeps MS before statting any
+// entry whose name matches the glob PATTERN, to stand in for a hung mount.
+static char *stat_delay_pattern;
+static int stat_delay_ms;
+
+void stat_pool_init(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&stat_pool.done, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+void stat_job_release(struct stat_job *job) {
+    if (--job->refs == 0) free(job);
+}
+
+void stat_delay(const char *name) {
+    if (!stat_delay_pattern || fnmatch(stat_delay_pattern, name, 0) != 0) return;
+    struct timespec ts = { stat_delay_ms / 1000, (stat_delay_ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {}
+}
+
+void *stat_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&stat_pool.lock);
+    for (;;) {
+        struct stat_job *job = stat_pool.jobs;
+        if (!job) {
+            pthread_cond_wait(&stat_pool.work, &stat_pool.lock);
+            continue;
+        }
+        struct stat_slot *s = &job->slots[job->next_slot++];
+        if (job->next_slot == job->count) stat_pool.jobs = job->next;
+        if (s->state != SLOT_QUEUED) continue;
+        s->state = SLOT_RUNNING;
+        clock_gettime(CLOCK_MONOTONIC, &s->started);
+        job->refs++;
+        pthread_mutex_unlock(&stat_pool.lock);
+
+        char fullpath[1024];
+        join_path(fullpath, sizeof(fullpath), job->path, s->name);
+        struct stat st;
+        unsigned int got;
+        stat_delay(s->name);
+        int rc = stat_fetch(AT_FDCWD, fullpath, job->mask, &st, &got);
+
+        pthread_mutex_lock(&stat_pool.lock);
+        if (s->state == SLOT_RUNNING) {
+            s->state = rc == 0 ? SLOT_DONE : SLOT_FAILED;
+            s->st = st;
+            s->mask = got;
+            if (job->waiting == s - job->slots) pthread_cond_broadcast(&stat_pool.done);
+        } else {
+            stat_pool.hung--;
+        }
+        stat_job_release(job);
+
+        // A replacement was started while this worker was hung.
+        if (stat_pool.workers - stat_pool.hung > stat_pool.target) {
+            stat_pool.workers--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stat_pool.lock);
+    return NULL;
+}
+
+// Starts workers until target are free. Called with the lock held.
+void stat_pool_grow(void) {
+    while (stat_pool.workers - stat_pool.hung < stat_pool.target &&
+           stat_pool.hung <= STAT_MAX_HUNG) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, stat_worker, NULL) != 0) break;
+        pthread_detach(tid);
+        stat_pool.workers++;
+    }
+}
+
+// Local filesystems answer stat promptly (or fail), so only directories
+// on network and FUSE filesystems pay for the hand-off to the pool.
+int remote_fs(const char *path) {
+    static const unsigned long magics[] = {
+        NFS_SUPER_MAGIC, CIFS_SUPER_MAGIC, SMB2_SUPER_MAGIC, SMB_SUPER_MAGIC,
+        FUSE_SUPER_MAGIC, V9FS_MAGIC, CEPH_SUPER_MAGIC, AFS_SUPER_MAGIC, CODA_SUPER_MAGIC
+    };
+    struct statfs sfs;
+    if (statfs(path, &sfs) == -1) return 0;
+    for (size_t i = 0; i < sizeof(magics) / sizeof(magics[0]); i++)
+        if ((unsigned long)sfs.f_type == magics[i]) return 1;
+    return 0;
+}
+
+void timespec_add_ms(struct timespec *ts, int ms) {
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+int timespec_before(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Fetches the fields in need for every entry that lacks them on the pool and
+// collects the results in order. An entry's deadline runs from when a
+// worker started it, or from when the caller began waiting for it if no
+// worker was free. Entries that miss it are marked stale and reported.
+// Directories on local filesystems are left to stat_row as before.
+void fetch_stats(const char *path, struct entry_table *t, unsigned int need) {
+    int count = t->count;
+    if (stat_timeout_ms <= 0 || count == 0) return;
+    if (!stat_delay_pattern && !remote_fs(path)) return;
+
+    int pending = 0;
+    size_t names_size = strlen(path) + 1;
+    for (int i = 0; i < count; i++) {
+        if ((t->stat_mask[i] & need) == need || (t->flags[i] & ENTRY_STALE)) continue;
+        pending++;
+        names_size += t->name_len[i] + 1;
+    }
+    if (pending == 0) return;
+
+    struct stat_job *job = malloc(sizeof(*job) + pending * sizeof(struct stat_slot) + names_size);
+    if (!job) { perror("malloc"); return; }
+    job->slots = (struct stat_slot *)(job + 1);
+    char *names = (char *)(job->slots + pending);
+    job->path = strcpy(names, path);
+    names += strlen(path) + 1;
+    job->count = pending;
+    job->mask = need;
+    job->next_slot = 0;
+    job->waiting = -1;
+    job->refs = 1;
+    job->next = NULL;
+    for (int i = 0, k = 0; i < count; i++) {
+        if ((t->stat_mask[i] & need) == need || (t->flags[i] & ENTRY_STALE)) continue;
+        struct stat_slot *s = &job->slots[k++];
+        memset(s, 0, sizeof(*s));
+        s->index = i;
+        s->name = strcpy(names, entry_name(t, i));
+        names += strlen(names) + 1;
+    }
+
+    pthread_once(&stat_pool_once, stat_pool_init);
+    pthread_mutex_lock(&stat_pool.lock);
+    stat_pool_grow();
+    struct stat_job **tail = &stat_pool.jobs;
+    while (*tail) tail = &(*tail)->next;
+    *tail = job;
+    pthread_cond_broadcast(&stat_pool.work);
+
+    for (int k = 0; k < pending; k++) {
+        struct stat_slot *s = &job->slots[k];
+        struct timespec waiting, deadline, now;
+        clock_gettime(CLOCK_MONOTONIC, &waiting);
+        job->waiting = k;
+        for (;;) {
+            if (s->state != SLOT_QUEUED && s->state != SLOT_RUNNING) break;
+            deadline = s->state == SLOT_RUNNING ? s->started : waiting;
+            timespec_add_ms(&deadline, stat_timeout_ms);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (!timespec_before(&now, &deadline)) break;
+            pthread_cond_timedwait(&stat_pool.done, &stat_pool.lock, &deadline);
+        }
+        job->waiting = -1;
+
+        switch (s->state) {
+            case SLOT_DONE:
+                row_set_stat(t, s->index, &s->st, s->mask);
+                continue;
+            case SLOT_FAILED:
+                continue;            // stat_row retries and the entry is skipped as before
+            case SLOT_RUNNING:
+                s->state = SLOT_TIMED_OUT;
+                stat_pool.hung++;
+                stat_pool_grow();
+                break;
+            default:
+                s->state = SLOT_ABANDONED;
+                break;
+        }
+        t->flags[s->index] |= ENTRY_STALE;
+        fprintf(stderr, "%s/%s: stat timed out after %d ms\n", path, s->name, stat_timeout_ms);
+    }
+
+    if (job->next_slot < job->count) {
+        struct stat_job **p = &stat_pool.jobs;
+        while (*p != job) p = &(*p)->next;
+        *p = job->next;
+    }
+    stat_job_release(job);
+    pthread_mutex_unlock(&stat_pool.lock);
+}
+
+// ---------------- ROW BATCHES -----------------
+// Per-entry syscalls made after the stat pass (xattrs, readlink) run
+// over contiguous batches of rows, one per thread once a directory has
+// more than ROW_BATCH_ROWS rows, which covers the large directories a
+// -R walk meets; smaller ones stay on the calling thread. Each row is
+// written by one thread only, and strings a batch produces go to its
+// own arena, merged by the caller afterwards.
+struct row_batch {
+    const char *path;
+    struct entry_table *t;
+    int from;
+    int to;
+    unsigned int mask;           // rows without these fields are skipped
+    const struct ls_options *opts;
+    char *arena;
+    size_t arena_len;
+    size_t arena_cap;
+    pthread_t tid;
+    int started;
+};
+
+// Copies s into the batch's arena; returns its offset there, or -1.
+long batch_store(struct row_batch *b, const char *s, size_t len) {
+    if (b->arena_len + len + 1 > b->arena_cap) {
+        size_t cap = b->arena_cap ? b->arena_cap : 1024;
+        while (b->arena_len + len + 1 > cap) cap *= 2;
+        char *grown = realloc(b->arena, cap);
+        if (!grown) { perror("realloc"); return -1; }
+        b->arena = grown;
+        b->arena_cap = cap;
+    }
+    long off = b->arena_len;
+    memcpy(b->arena + off, s, len);
+    b->arena[off + len] = '\0';
+    b->arena_len += len + 1;
+    return off;
+}
+
+// Runs fn over every row of t and returns the batches (*n of them) for
+// the caller to merge and free, or NULL.
+struct row_batch *run_batches(const char *path, struct entry_table *t, unsigned int mask,
+                              const struct ls_options *opts, void *(*fn)(void *), int *n) {
+    int nthreads = t->count / ROW_BATCH_ROWS;
+    if (nthreads > thread_count(opts)) nthreads = thread_count(opts);
+    if (nthreads < 1) nthreads = 1;
+    struct row_batch *batches = calloc(nthreads, sizeof(*batches));
+    if (!batches) { perror("calloc"); return NULL; }
+
+    for (int k = 0; k < nthreads; k++) {
+        batches[k] = (struct row_batch){
+            .path = path, .t = t, .mask = mask, .opts = opts,
+            .from = (long)t->count * k / nthreads,
+            .to = (long)t->count * (k + 1) / nthreads,
+        };
+        if (k > 0) batches[k].started = pthread_create(&batches[k].tid, NULL, fn, &batches[k]) == 0;
+    }
+    // A batch whose thread could not be started is done here.
+    fn(&batches[0]);
+    for (int k = 1; k < nthreads; k++) {
+        if (batches[k].started) pthread_join(batches[k].tid, NULL);
+        else fn(&batches[k]);
+    }
+    *n = nthreads;
+    return batches;
+}
+
+// ---------------- XATTRS -----------------
+// ACL markers and security contexts come from extended attributes, one
+// or two syscalls per file, so they are fetched only for --acl and -Z.
+// A single llistxattr tells whether a file has an ACL and a context; the
+// context itself is read only for -Z. Filesystems that answer ENOTSUP
+// are remembered by device and not asked again.
+static _Atomic uint64_t xattr_off_devs[XATTR_MAX_DEVS];    // dev + 1, 0 = free
+static _Atomic int xattr_off_count;
+
+int xattr_supported(uint64_t dev) {
+    int n = xattr_off_count;
+    for (int i = 0; i < n && i < XATTR_MAX_DEVS; i++)
+        if (xattr_off_devs[i] == dev + 1) return 0;
+    return 1;
+}
+
+void xattr_unsupported(uint64_t dev) {
+    if (!xattr_supported(dev)) return;
+    int i = xattr_off_count++;
+    if (i < XATTR_MAX_DEVS) xattr_off_devs[i] = dev + 1;
+}
+
+// Contexts repeat across a tree, so each distinct one is stored once
+// and rows point at it. Strings are never freed.
+static struct {
+    pthread_mutex_t lock;
+    char **labels;
+    int count;
+    int capacity;
+} label_pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static _Thread_local const char *last_label;
+
+const char *intern_label(const char *s) {
+    if (last_label && strcmp(last_label, s) == 0) return last_label;
+    const char *found = NULL;
+    pthread_mutex_lock(&label_pool.lock);
+    for (int i = 0; i < label_pool.count && !found; i++)
+        if (strcmp(label_pool.labels[i], s) == 0) found = label_pool.labels[i];
+    if (!found && label_pool.count == label_pool.capacity) {
+        int cap = label_pool.capacity ? label_pool.capacity * 2 : 16;
+        char **grown = realloc(label_pool.labels, cap * sizeof(*grown));
+        if (grown) {
+            label_pool.labels = grown;
+            label_pool.capacity = cap;
+        }
+    }
+    if (!found && label_pool.count < label_pool.capacity && (found = strdup(s)))
+        label_pool.labels[label_pool.count++] = (char *)found;
+    pthread_mutex_unlock(&label_pool.lock);
+    if (found) last_label = found;
+    return found;
+}
+
+// Sets ENTRY_ACL / ENTRY_LABEL (and the label for -Z) on row i, whose
+// type and device are already known.
+void row_xattrs(const char *path, struct entry_table *t, int i, int want_label) {
+    t->flags[i] |= ENTRY_XATTRS;
+    if (!xattr_supported(t->dev[i])) return;
+    // Linux has no ACLs on symlinks; only a context can be there.
+    if (!want_label && S_ISLNK(t->mode[i])) return;
+
+    char fullpath[1024];
+    join_path(fullpath, sizeof(fullpath), path, entry_name(t, i));
+    char names[1024];
+    char *list = names;
+    ssize_t n = llistxattr(fullpath, list, sizeof(names));
+    if (n == -1 && errno == ERANGE) {
+        n = llistxattr(fullpath, NULL, 0);
+        list = n > 0 ? malloc(n) : NULL;
+        n = list ? llistxattr(fullpath, list, n) : -1;
+    }
+    if (n == -1 && (errno == ENOTSUP || errno == EOPNOTSUPP)) xattr_unsupported(t->dev[i]);
+
+    for (ssize_t off = 0; off < n; off += strlen(list + off) + 1) {
+        const char *name = list + off;
+        if (strcmp(name, "system.posix_acl_access") == 0 || strcmp(name, "system.posix_acl_default") == 0)
+            t->flags[i] |= ENTRY_ACL;
+        else if (strcmp(name, "security.selinux") == 0)
+            t->flags[i] |= ENTRY_LABEL;
+    }
+    if (list != names) free(list);
+
+    if (want_label && (t->flags[i] & ENTRY_LABEL)) {
+        char label[256];
+        ssize_t len = lgetxattr(fullpath, "security.selinux", label, sizeof(label) - 1);
+        if (len > 0) {
+            label[len] = '\0';
+            t->label[i] = intern_label(label);
+        }
+    }
+}
+
+void *xattr_worker(void *arg) {
+    struct row_batch *b = arg;
+    struct entry_table *t = b->t;
+    for (int i = b->from; i < b->to; i++) {
+        if (t->flags[i] & (ENTRY_STALE | ENTRY_XATTRS)) continue;
+        if ((t->stat_mask[i] & b->mask) != b->mask) continue;
+        row_xattrs(b->path, t, i, b->opts->show_context);
+    }
+    return NULL;
+}
+
+// Fetches the xattr bits of every row that has the fields in mask.
+// Saved tables describe the tree as it was; nothing is read for them.
+void fetch_xattrs(const char *path, struct entry_table *t, unsigned int mask,
+                  const struct ls_options *opts) {
+    if (t->saved) return;
+    if (opts->show_context && table_need(t, (void **)&t->label, sizeof(*t->label)) == -1) return;
+    int n;
+    free(run_batches(path, t, mask, opts, xattr_worker, &n));
+}
+
+// ---------------- LINKS -----------------
+// "name -> target" in -l, and the color of links whose target is
+// missing. Only rows whose mode says S_IFLNK are looked at: readlink is
+// called for long listings, and a stat through the link (for dangling
+// links) only when names are colored.
+void *link_worker(void *arg) {
+    struct row_batch *b = arg;
+    struct entry_table *t = b->t;
+    for (int i = b->from; i < b->to; i++) {
+        if (t->flags[i] & (ENTRY_STALE | ENTRY_TARGET)) continue;
+        if ((t->stat_mask[i] & b->mask) != b->mask || !S_ISLNK(t->mode[i])) continue;
+
+        char fullpath[1024];
+        join_path(fullpath, sizeof(fullpath), b->path, entry_name(t, i));
+        if (b->opts->long_format) {
+            char target[PATH_MAX];
+            ssize_t n = readlink(fullpath, target, sizeof(target));
+            long off = n >= 0 ? batch_store(b, target, n) : -1;
+            if (off != -1) {
+                t->target_off[i] = off;
+                t->flags[i] |= ENTRY_TARGET;
+            }
+        }
+        struct stat st;
+        if (b->opts->color && stat(fullpath, &st) == -1) t->flags[i] |= ENTRY_DANGLING;
+    }
+    return NULL;
+}
+
+// Reads the targets of the symlinks among the rows that have the fields
+// in mask, then appends each batch's strings to the table's arena.
+void fetch_links(const char *path, struct entry_table *t, unsigned int mask,
+                 const struct ls_options *opts) {
+    if (t->saved || (!opts->long_format && !opts->color)) return;
+    if (table_need(t, (void **)&t->target_off, sizeof(*t->target_off)) == -1) return;
+    int n;
+    struct row_batch *batches = run_batches(path, t, mask, opts, link_worker, &n);
+    if (!batches) return;
+
+    for (int k = 0; k < n; k++) {
+        struct row_batch *b = &batches[k];
+        if (b->arena_len == 0) continue;
+        char *grown = realloc(t->targets, t->targets_len + b->arena_len);
+        if (!grown) {
+            perror("realloc");
+            for (int i = b->from; i < b->to; i++) t->flags[i] &= ~ENTRY_TARGET;
+        } else {
+            t->targets = grown;
+            memcpy(t->targets + t->targets_len, b->arena, b->arena_len);
+            for (int i = b->from; i < b->to; i++)
+                if (t->flags[i] & ENTRY_TARGET) t->target_off[i] += t->targets_len;
+            t->targets_len += b->arena_len;
+        }
+        free(b->arena);
+    }
+    free(batches);
+}
+
+// ---------------- NAME CACHE -----------------
+// uid/gid -> name, so NSS is asked once per distinct owner.
+struct id_name {
+    unsigned int id;
+    char *name;          // NULL if the id has no name
+};
+
+// Names are never freed, so returned pointers stay valid for the life
+// of the process and may be used without holding the lock.
+struct id_cache {
+    struct id_name *items;
+    int count;
+    pthread_mutex_t lock;
+};
+
+static struct id_cache user_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static struct id_cache group_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+const char *cached_name(struct id_cache *cache, unsigned int id, int is_group) {
+    pthread_mutex_lock(&cache->lock);
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->items[i].id == id) {
+            const char *name = cache->items[i].name;
+            pthread_mutex_unlock(&cache->lock);
+            return name;
+        }
+    }
+
+    char buf[4096];
+    const char *found = NULL;
+    if (is_group) {
+        struct group gr, *res;
+        if (getgrgid_r(id, &gr, buf, sizeof(buf), &res) == 0 && res) found = gr.gr_name;
+    } else {
+        struct passwd pw, *res;
+        if (getpwuid_r(id, &pw, buf, sizeof(buf), &res) == 0 && res) found = pw.pw_name;
+    }
+    char *name = found ? strdup(found) : NULL;
+
+    struct id_name *items = realloc(cache->items, (cache->count + 1) * sizeof(*items));
+    if (items) {
+        cache->items = items;
+        items[cache->count].id = id;
+        items[cache->count].name = name;
+        cache->count++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return name;
+}
+
+const char *user_name(uid_t uid) { return cached_name(&user_cache, uid, 0); }
+const char *group_name(gid_t gid) { return cached_name(&group_cache, gid, 1); }
+
+// ---------------- JSON -----------------
+// Length of the well-formed UTF-8 sequence starting at p (a byte of
+// 0x80 or more), or 0 if the bytes there are not one.
+size_t utf8_sequence(const unsigned char *p) {
+    unsigned char lo = 0x80, hi = 0xbf;
+    size_t n;
+    if (p[0] >= 0xc2 && p[0] <= 0xdf) n = 2;
+    else if (p[0] >= 0xe0 && p[0] <= 0xef) n = 3;
+    else if (p[0] >= 0xf0 && p[0] <= 0xf4) n = 4;
+    else return 0;
+    // No overlong forms, surrogates or code points past U+10FFFF.
+    if (p[0] == 0xe0) lo = 0xa0;
+    else if (p[0] == 0xed) hi = 0x9f;
+    else if (p[0] == 0xf0) lo = 0x90;
+    else if (p[0] == 0xf4) hi = 0x8f;
+    if (p[1] < lo || p[1] > hi) return 0;
+    for (size_t k = 2; k < n; k++)
+        if (p[k] < 0x80 || p[k] > 0xbf) return 0;
+    return n;
+}
+
+// Copies runs of bytes that need no escaping in one go. Names are bytes,
+// not text: a byte that is not part of well-formed UTF-8 is written as
+// U+FFFD, so the output is always valid JSON. Returns nonzero when that
+// happened, so the caller can add the raw bytes (see json_name).
+int json_string(struct outbuf *ob, const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    int lossy = 0;
+    out_write(ob, "\"", 1);
+    const char *run = s;
+    for (const unsigned char *p = (const unsigned char *)s; ; p++) {
+        unsigned char c = *p;
+        if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') continue;
+        if (c >= 0x80) {
+            size_t n = utf8_sequence(p);
+            if (n) { p += n - 1; continue; }
+        }
+        if ((const char *)p > run) out_write(ob, run, (const char *)p - run);
+        if (c == '\0') break;
+        char esc[6] = { '\\', 0 };
+        size_t n = 2;
+        switch (c) {
+            case '"':  esc[1] = '"'; break;
+            case '\\': esc[1] = '\\'; break;
+            case '\n': esc[1] = 'n'; break;
+            case '\t': esc[1] = 't'; break;
+            case '\r': esc[1] = 'r'; break;
+            default:
+                if (c >= 0x80) {
+                    memcpy(esc, "\\ufffd", 6);
+                    lossy = 1;
+                } else {
+                    esc[1] = 'u'; esc[2] = '0'; esc[3] = '0';
+                    esc[4] = hex[c >> 4]; esc[5] = hex[c & 15];
+                }
+                n = 6;
+        }
+        out_write(ob, esc, n);
+        run = (const char *)p + 1;
+    }
+    out_write(ob, "\"", 1);
+    return lossy;
+}
+
+// Writes "key":"s" and, when s is not valid UTF-8, "key_bytes" with the
+// raw bytes in hex so the name can be recovered exactly.
+void json_name(struct outbuf *ob, const char *key, const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    out_printf(ob, "\"%s\":", key);
+    if (!json_string(ob, s)) return;
+    out_printf(ob, ",\"%s_bytes\":\"", key);
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        char pair[2] = { hex[*p >> 4], hex[*p & 15] };
+        out_write(ob, pair, 2);
+    }
+    out_write(ob, "\"", 1);
+}
+
+const char *type_name(mode_t mode) {
+    switch (mode & S_IFMT) {
+        case S_IFREG:  return "file";
+        case S_IFDIR:  return "dir";
+        case S_IFLNK:  return "symlink";
+        case S_IFBLK:  return "block";
+        case S_IFCHR:  return "char";
+        case S_IFIFO:  return "fifo";
+        case S_IFSOCK: return "socket";
+    }
+    return "unknown";
+}
+
+void json_field(struct outbuf *ob, const char *key, long long v) {
+    out_str(ob, key);
+    out_i64(ob, v);
+}
+
+void json_entry(struct outbuf *ob, int format, const char *dir, const char *name, const struct stat *st) {
+    if (format == FORMAT_JSON)
+        out_str(ob, ob->records ? ",\n" : "\n");
+    ob->records++;
+
+    const char *user = user_name(st->st_uid);
+    const char *group = group_name(st->st_gid);
+
+    out_str(ob, "{");
+    json_name(ob, "path", dir);
+    out_str(ob, ",");
+    json_name(ob, "name", name);
+    out_str(ob, ",\"type\":\"");
+    out_str(ob, type_name(st->st_mode));
+    json_field(ob, "\",\"mode\":", st->st_mode);
+    json_field(ob, ",\"nlink\":", st->st_nlink);
+    json_field(ob, ",\"uid\":", st->st_uid);
+    json_field(ob, ",\"gid\":", st->st_gid);
+    out_str(ob, ",\"user\":");
+    if (user) json_string(ob, user); else out_str(ob, "null");
+    out_str(ob, ",\"group\":");
+    if (group) json_string(ob, group); else out_str(ob, "null");
+    json_field(ob, ",\"size\":", st->st_size);
+    json_field(ob, ",\"blocks\":", st->st_blocks);
+    json_field(ob, ",\"ino\":", st->st_ino);
+    json_field(ob, ",\"atime\":", st->st_atime);
+    json_field(ob, ",\"mtime\":", st->st_mtime);
+    json_field(ob, ",\"ctime\":", st->st_ctime);
+    out_str(ob, format == FORMAT_NDJSON ? "}\n" : "}");
+}
+
+// ---------------- GATHER FILES -----------------
+int gather_cached(const char *path, const struct ls_options *opts, struct entry_table *t,
+                  int *count, size_t *longest);
+int table_cache_enabled(void);
+
+// Fills t with every entry that passes the name filters, sorted by name.
+// Entries failing the metadata predicates are kept (without
+// ENTRY_MATCHED) because -R still has to descend into them; *count is
+// the number that matched and *longest the longest matching name.
+// Returns -1 if the directory cannot be read.
+int gather_filenames(const char *path, const struct ls_options *opts, struct entry_table *t,
+                     int *count, size_t *longest) {
+    memset(t, 0, sizeof(*t));
+    // Cached rows hold the links themselves, not what -L shows.
+    if (!stat_follow && (opts->use_cache || table_cache_enabled()) &&
+        gather_cached(path, opts, t, count, longest) == 0)
+        return 0;
+
+    DIR *d = opendir(path);
+    if (!d) { perror("opendir"); return -1; }
+
+    unsigned int pmask = predicate_mask(&opts->pred);
+    struct dirent *entry;
+    *count = 0;
+    *longest = 0;
+
+    while ((entry = readdir(d)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        int wanted = name_wanted(entry->d_name, len, opts);
+        if (!wanted) continue;
+
+        int i = table_add(t, entry->d_name, len, entry->d_type);
+        if (i == -1) break;
+        int matched = wanted == NAME_SHOWN && row_matches(dirfd(d), t, i, &opts->pred, pmask);
+
+        // Non-matching entries are only worth keeping if -R may enter them.
+        if (!matched && !(opts->recursive_flag &&
+                          (t->d_type[i] == DT_DIR || t->d_type[i] == DT_UNKNOWN))) {
+            table_pop(t);
+            continue;
+        }
+        if (matched) {
+            t->flags[i] |= ENTRY_MATCHED;
+            if (len > *longest) *longest = len;
+            (*count)++;
+        }
+    }
+
+    closedir(d);
+    if (!opts->unsorted)
+        table_sort(t);
+    return 0;
+}
+
+// ---------------- DISPLAY -----------------
+// Text listings are written in two passes. The first fetches whatever
+// metadata the format needs and measures each column; the second writes
+// the rows from the table, padded to those widths, with no syscalls.
+#define LONG_STATX (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID | \
+                    STATX_SIZE | STATX_BLOCKS | STATX_MTIME)
+#define SUMMARY_STATX (STATX_TYPE | STATX_NLINK | STATX_SIZE | STATX_BLOCKS | STATX_INO | STATX_MTIME)
+
+struct layout {
+    unsigned int mask;           // statx fields every shown row has
+    int ino;
+    int blocks;
+    int nlink;
+    int user;
+    int group;
+    int size;
+    int label;                   // -Z
+    int marker;                  // -l with --acl or -Z: some row has '+' or '.'
+    long long total;             // 1K blocks, for the "total" line
+};
+
+int digits(unsigned long long v) {
+    int n = 1;
+    while (v >= 10) { v /= 10; n++; }
+    return n;
+}
+
+// -h: sizes the way ls -h prints them, rounded up: 999, 1.5K, 12M.
+void human_size(long long size, char *buf, size_t n) {
+    static const char units[] = "KMGTPE";
+    if (size < 1024) { snprintf(buf, n, "%lld", size); return; }
+    long double v = size;
+    int u = -1;
+    while (v >= 1024 && u < 5) { v /= 1024; u++; }
+    if (v < 10) {
+        long long tenths = (long long)(v * 10);
+        if (tenths < v * 10) tenths++;
+        if (tenths < 100) {
+            snprintf(buf, n, "%lld.%lld%c", tenths / 10, tenths % 10, units[u]);
+            return;
+        }
+    }
+    long long whole = (long long)v;
+    if (whole < v) whole++;
+    if (whole >= 1024 && u < 5) snprintf(buf, n, "1.0%c", units[u + 1]);
+    else snprintf(buf, n, "%lld%c", whole, units[u]);
+}
+
+void format_size(long long size, const struct ls_options *opts, char *buf, size_t n) {
+    if (opts->human_sizes) human_size(size, buf, n);
+    else snprintf(buf, n, "%lld", size);
+}
+
+// -s counts 1K blocks; st_blocks is in 512-byte units.
+void format_blocks(long long blocks, const struct ls_options *opts, char *buf, size_t n) {
+    if (opts->human_sizes) human_size(blocks * 512, buf, n);
+    else snprintf(buf, n, "%lld", (blocks + 1) / 2);
+}
+
+// Without color a short listing needs no metadata at all.
+unsigned int display_mask(const struct ls_options *opts) {
+    unsigned int mask = opts->long_format ? LONG_STATX : opts->color ? STATX_TYPE | STATX_MODE : 0;
+    if (opts->show_inode) mask |= STATX_INO;
+    if (opts->show_blocks) mask |= STATX_BLOCKS;
+    if (opts->show_context || opts->show_acl) mask |= STATX_INO;     // the device, for xattr_supported
+    if (opts->summarize) mask |= SUMMARY_STATX;
+    return mask;
+}
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// Pass one: stats every row and measures the columns.
+void measure_entries(const char *path, struct entry_table *t, const struct ls_options *opts,
+                     struct layout *lay) {
+    memset(lay, 0, sizeof(*lay));
+    lay->mask = display_mask(opts);
+    if (lay->mask == 0) return;
+    fetch_stats(path, t, lay->mask);
+
+    char buf[32];
+    for (int i = 0; i < t->count; i++) {
+        if ((t->flags[i] & ENTRY_STALE) || stat_row(path, t, i, lay->mask) == -1) continue;
+        if (opts->show_inode) lay->ino = MAX(lay->ino, digits(t->ino[i]));
+        if (lay->mask & STATX_BLOCKS) {
+            lay->total += (t->blocks[i] + 1) / 2;
+            format_blocks(t->blocks[i], opts, buf, sizeof(buf));
+            lay->blocks = MAX(lay->blocks, (int)strlen(buf));
+        }
+        if (!opts->long_format) continue;
+
+        const char *user = user_name(t->uid[i]);
+        const char *group = group_name(t->gid[i]);
+        lay->nlink = MAX(lay->nlink, digits(t->nlink[i]));
+        lay->user = MAX(lay->user, (int)strlen(user ? user : "?"));
+        lay->group = MAX(lay->group, (int)strlen(group ? group : "?"));
+        format_size(t->size[i], opts, buf, sizeof(buf));
+        lay->size = MAX(lay->size, (int)strlen(buf));
+    }
+    fetch_links(path, t, lay->mask, opts);
+    if (!opts->show_context && !opts->show_acl) return;
+
+    fetch_xattrs(path, t, lay->mask, opts);
+    for (int i = 0; i < t->count; i++) {
+        if (!(t->flags[i] & ENTRY_XATTRS)) {
+            if ((t->flags[i] & ENTRY_STALE) || t->saved) lay->label = MAX(lay->label, 1);
+            continue;
+        }
+        if (t->flags[i] & (ENTRY_ACL | ENTRY_LABEL)) lay->marker = opts->long_format;
+        if (opts->show_context) lay->label = MAX(lay->label, (int)strlen(t->label[i] ? t->label[i] : "?"));
+    }
+}
+
+// Rows whose stat failed in pass one are left out, as before.
+int row_shown(const struct entry_table *t, int i, const struct layout *lay) {
+    return (t->flags[i] & ENTRY_STALE) || (t->stat_mask[i] & lay->mask) == lay->mask;
+}
+
+void print_total(const struct layout *lay, const struct ls_options *opts) {
+    char buf[32];
+    if (opts->human_sizes) human_size(lay->total * 1024, buf, sizeof(buf));
+    else snprintf(buf, sizeof(buf), "%lld", lay->total);
+    out_printf(&out, "total %s\n", buf);
+}
+
+int prefix_width(const struct ls_options *opts, const struct layout *lay) {
+    return (opts->show_inode ? lay->ino + 1 : 0) + (opts->show_blocks ? lay->blocks + 1 : 0) +
+           (opts->show_context && !opts->long_format ? lay->label + 1 : 0);
+}
+
+// -Z: a row's context, "?" if it has none or it is unknown.
+const char *row_label(const struct entry_table *t, int i) {
+    return (t->flags[i] & ENTRY_XATTRS) && t->label[i] ? t->label[i] : "?";
+}
+
+// '+', '.' or ' ' after the permissions, '\0' when no row needs one.
+char row_marker(const struct entry_table *t, int i, const struct layout *lay) {
+    if (!lay->marker) return '\0';
+    if (t->flags[i] & ENTRY_ACL) return '+';
+    return t->flags[i] & ENTRY_LABEL ? '.' : ' ';
+}
+
+// The -i, -s and (short formats) -Z columns in front of a name; returns
+// the width written.
+int print_prefix(const struct entry_table *t, int i, const struct ls_options *opts,
+                 const struct layout *lay) {
+    int stale = t->flags[i] & ENTRY_STALE;
+    int label = opts->show_context && !opts->long_format;
+    char buf[32];
+    if (opts->show_inode) {
+        if (stale) out_printf(&out, "%*s ", lay->ino, "?");
+        else out_printf(&out, "%*llu ", lay->ino, (unsigned long long)t->ino[i]);
+    }
+    if (opts->show_blocks) {
+        if (stale) snprintf(buf, sizeof(buf), "?");
+        else format_blocks(t->blocks[i], opts, buf, sizeof(buf));
+        out_printf(&out, "%*s ", lay->blocks, buf);
+    }
+    if (label) out_printf(&out, "%-*s ", lay->label, row_label(t, i));
+    return prefix_width(opts, lay);
+}
+
+// Pass two of -l for rows[0..n), or the first n rows if rows is NULL.
+void display_long_listing(const struct entry_table *t, const int *rows, int n,
+                          const struct ls_options *opts, const struct layout *lay) {
+    char buf[32];
+    for (int k = 0; k < n; k++) {
+        int i = rows ? rows[k] : k;
+        if (!row_shown(t, i, lay)) continue;
+        print_prefix(t, i, opts, lay);
+        if (t->flags[i] & ENTRY_STALE) {
+            out_printf(&out, "??????????%s %*s %-*s %-*s ", lay->marker ? " " : "", lay->nlink, "?",
+                       lay->user, "?", lay->group, "?");
+            if (opts->show_context) out_printf(&out, "%-*s ", lay->label, "?");
+            out_printf(&out, "%*s ? ", lay->size, "?");
+            out_str(&out, entry_name(t, i));
+            out_str(&out, "\n");
+            continue;
+        }
+
+        print_permissions(t->mode[i], row_marker(t, i, lay));
+        out_printf(&out, "%*lu ", lay->nlink, (unsigned long)t->nlink[i]);
+
+        const char *user = user_name(t->uid[i]);
+        const char *group = group_name(t->gid[i]);
+        out_printf(&out, "%-*s %-*s ", lay->user, user ? user : "?", lay->group, group ? group : "?");
+        if (opts->show_context) out_printf(&out, "%-*s ", lay->label, row_label(t, i));
+
+        format_size(t->size[i], opts, buf, sizeof(buf));
+        out_printf(&out, "%*s ", lay->size, buf);
+
+        char time_str[32];
+        time_t mtime = t->mtime[i];
+        ctime_r(&mtime, time_str);
+        time_str[strlen(time_str)-1] = '\0';
+        out_printf(&out, "%s ", time_str);
+
+        opts->print_name(t, i);
+        if (t->flags[i] & ENTRY_TARGET) {
+            const char *target = t->targets + t->target_off[i];
+            out_str(&out, " -> ");
+            if (opts->color && (t->flags[i] & ENTRY_DANGLING))
+                out_printf(&out, COLOR_ORPHAN "%s" COLOR_RESET, target);
+            else out_str(&out, target);
+        }
+        out_str(&out, "\n");
+    }
+}
+
+// -l without -i, -s, -h, -Z or --acl: the rows display_long_listing
+// writes, field by field without printf, formatting a timestamp once
+// for a run of equal mtimes. Stale rows go to the general version.
+void display_long_plain(const struct entry_table *t, const int *rows, int n,
+                        const struct ls_options *opts, const struct layout *lay) {
+    char perms[12], time_str[32];
+    size_t time_len = 0;
+    time_t time_of = 0;
+    for (int k = 0; k < n; k++) {
+        int i = rows ? rows[k] : k;
+        if (!row_shown(t, i, lay)) continue;
+        if (t->flags[i] & ENTRY_STALE) {
+            display_long_listing(t, &i, 1, opts, lay);
+            continue;
+        }
+
+        format_permissions(t->mode[i], ' ', perms);
+        out_write(&out, perms, 11);
+        out_number(&out, t->nlink[i], lay->nlink);
+        out_write(&out, " ", 1);
+
+        const char *user = user_name(t->uid[i]);
+        const char *group = group_name(t->gid[i]);
+        if (!user) user = "?";
+        if (!group) group = "?";
+        size_t len = strlen(user);
+        out_write(&out, user, len);
+        out_pad(&out, lay->user - (int)len + 1);
+        len = strlen(group);
+        out_write(&out, group, len);
+        out_pad(&out, lay->group - (int)len + 1);
+
+        out_number(&out, t->size[i], lay->size);
+        out_write(&out, " ", 1);
+
+        if (time_len == 0 || t->mtime[i] != time_of) {
+            time_of = t->mtime[i];
+            ctime_r(&time_of, time_str);
+            time_len = strlen(time_str);
+            time_str[time_len - 1] = ' ';
+        }
+        out_write(&out, time_str, time_len);
+
+        opts->print_name(t, i);
+        if (t->flags[i] & ENTRY_TARGET) {
+            const char *target = t->targets + t->target_off[i];
+            out_str(&out, " -> ");
+            if (opts->color && (t->flags[i] & ENTRY_DANGLING))
+                out_printf(&out, COLOR_ORPHAN "%s" COLOR_RESET, target);
+            else out_str(&out, target);
+        }
+        out_write(&out, "\n", 1);
+    }
+}
+
+void render_long(const struct entry_table *t, size_t longest, const struct ls_options *opts,
+                 const struct layout *lay) {
+    (void)longest;
+    opts->render_rows(t, NULL, t->count, opts, lay);
+}
+
+void print_name_plain(const struct entry_table *t, int i) {
+    out_write(&out, entry_name(t, i), t->name_len[i]);
+}
+
+// Stale rows have no mode and are shown uncolored.
+void print_name_color(const struct entry_table *t, int i) {
+    if (t->flags[i] & ENTRY_STALE) print_name_plain(t, i);
+    else if (t->flags[i] & ENTRY_DANGLING) out_printf(&out, COLOR_ORPHAN "%s" COLOR_RESET, entry_name(t, i));
+    else print_colored(entry_name(t, i), t->mode[i]);
+}
+
+// -1 with color or prefix columns.
+void display_single(const struct entry_table *t, size_t longest, const struct ls_options *opts,
+                    const struct layout *lay) {
+    (void)longest;
+    for (int i = 0; i < t->count; i++) {
+        if (!row_shown(t, i, lay)) continue;
+        print_prefix(t, i, opts, lay);
+        opts->print_name(t, i);
+        out_write(&out, "\n", 1);
+    }
+}
+
+// -1 with nothing but names: each is copied straight into the output
+// buffer, falling back to out_write only when it is full.
+void display_single_plain(const struct entry_table *t, size_t longest, const struct ls_options *opts,
+                          const struct layout *lay) {
+    (void)longest;
+    (void)opts;
+    (void)lay;
+    for (int i = 0; i < t->count; i++) {
+        size_t n = t->name_len[i];
+        if (!out.buf || out.len + n + 1 > out.cap) {
+            out_write(&out, entry_name(t, i), n);
+            out_write(&out, "\n", 1);
+            continue;
+        }
+        memcpy(out.buf + out.len, entry_name(t, i), n);
+        out.buf[out.len + n] = '\n';
+        out.len += n + 1;
+    }
+}
+
+void display_vertical(const struct entry_table *t, size_t longest, const struct ls_options *opts,
+                      const struct layout *lay) {
+    int term_width = get_terminal_width();
+    int col_width = longest + prefix_width(opts, lay) + SPACING;
+    int columns = term_width / col_width;
+    if (columns < 1) columns = 1;
+    int rows = (t->count + columns - 1) / columns;
+
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < columns; c++) {
+            int idx = c * rows + r;
+            if (idx < t->count) {
+                if (!row_shown(t, idx, lay)) continue;
+
+                print_prefix(t, idx, opts, lay);
+                opts->print_name(t, idx);
+                out_printf(&out, "%-*s", col_width, "");
+            }
+        }
+        out_str(&out, "\n");
+    }
+}
+
+void display_horizontal(const struct entry_table *t, size_t longest, const struct ls_options *opts,
+                        const struct layout *lay) {
+    (void)longest;
+    int term_width = get_terminal_width();
+    int current_width = 0;
+
+    for (int i = 0; i < t->count; i++) {
+        if (!row_shown(t, i, lay)) continue;
+
+        int len = print_prefix(t, i, opts, lay) + t->name_len[i] + SPACING;
+        opts->print_name(t, i);
+        current_width += len;
+        if (current_width >= term_width) {
+            out_str(&out, "\n");
+            current_width = len;
+        } else {
+            out_printf(&out, "%*s", SPACING, "");
+        }
+    }
+    out_str(&out, "\n");
+}
+
+// A text listing of t, with the "total" line for a directory.
+void display_text(const char *path, struct entry_table *t, size_t longest,
+                  const struct ls_options *opts, int with_total) {
+    struct layout lay;
+    measure_entries(path, t, opts, &lay);
+    if (with_total && (opts->long_format || opts->show_blocks))
+        print_total(&lay, opts);
+
+    opts->render(t, longest, opts, &lay);
+}
+
+void choose_renderer(struct ls_options *opts) {
+    opts->print_name = opts->color ? print_name_color : print_name_plain;
+    if (opts->long_format) {
+        opts->render = render_long;
+        opts->render_rows = opts->show_inode || opts->show_blocks || opts->human_sizes ||
+                            opts->show_context || opts->show_acl ? display_long_listing : display_long_plain;
+    }
+    else if (opts->one_per_line)
+        opts->render = display_mask(opts) == 0 ? display_single_plain : display_single;
+    else if (opts->horizontal_flag)
+        opts->render = display_horizontal;
+    else
+        opts->render = display_vertical;
+}
+
+void display_json(const char *path, struct entry_table *t, int format) {
+    fetch_stats(path, t, STATX_BASIC_STATS);
+    for (int i = 0; i < t->count; i++) {
+        if (t->flags[i] & ENTRY_STALE) continue;
+        if (stat_row(path, t, i, STATX_BASIC_STATS) == -1) continue;
+        struct stat st;
+        row_to_stat(t, i, &st);
+        json_entry(&out, format, path, entry_name(t, i), &st);
+    }
+}
+
+void display_entries(const char *path, struct entry_table *t, size_t longest,
+                     const struct ls_options *opts, int depth) {
+    if (opts->format == FORMAT_JSON || opts->format == FORMAT_NDJSON) {
+        display_json(path, t, opts->format);
+        return;
+    }
+    if (depth > 0) out_str(&out, "\n");
+    out_printf(&out, "%s:\n", path);
+    display_text(path, t, longest, opts, 1);
+}
+
+// ---------------- SUMMARY -----------------
+// -R --summarize: for every directory, the apparent size, allocated
+// blocks, file count and newest mtime of everything listed beneath it,
+// like du. The sums are taken from the metadata the listing already
+// fetched, and each directory's totals are returned to its parent, so
+// nothing is shared between the threads listing different operands.
+struct totals {
+    long long size;              // apparent bytes
+    long long blocks;            // 512-byte units
+    long long files;             // entries other than directories
+    int64_t newest;              // latest mtime, 0 if nothing was listed
+};
+
+// Open-addressed set of (dev, ino), so a file with several hard links is
+// counted once per operand. Only files with nlink > 1 are added.
+struct inode_set {
+    uint64_t *keys;              // dev, ino pairs; ino 0 = free slot
+    size_t capacity;             // pairs, a power of two
+    size_t count;
+};
+
+int inode_set_add(struct inode_set *s, uint64_t dev, uint64_t ino);
+
+int inode_set_grow(struct inode_set *s) {
+    struct inode_set bigger = { .capacity = s->capacity ? s->capacity * 2 : 1024 };
+    bigger.keys = calloc(bigger.capacity, 2 * sizeof(uint64_t));
+    if (!bigger.keys) { perror("calloc"); return -1; }
+    for (size_t i = 0; i < s->capacity; i++)
+        if (s->keys[2 * i + 1]) inode_set_add(&bigger, s->keys[2 * i], s->keys[2 * i + 1]);
+    free(s->keys);
+    *s = bigger;
+    return 0;
+}
+
+// Returns 1 if (dev, ino) was added, 0 if it was already there.
+int inode_set_add(struct inode_set *s, uint64_t dev, uint64_t ino) {
+    if (ino == 0) return 1;
+    if (2 * (s->count + 1) > s->capacity && inode_set_grow(s) == -1) return 1;
+    size_t mask = s->capacity - 1;
+    size_t i = (size_t)((ino * 0x9e3779b97f4a7c15ull) ^ dev) & mask;
+    while (s->keys[2 * i + 1]) {
+        if (s->keys[2 * i] == dev && s->keys[2 * i + 1] == ino) return 0;
+        i = (i + 1) & mask;
+    }
+    s->keys[2 * i] = dev;
+    s->keys[2 * i + 1] = ino;
+    s->count++;
+    return 1;
+}
+
+struct summary {
+    struct inode_set seen;
+    struct outbuf lines;         // fd -1: one line per directory, children first
+};
+
+void totals_add(struct totals *into, const struct totals *from) {
+    into->size += from->size;
+    into->blocks += from->blocks;
+    into->files += from->files;
+    if (from->newest > into->newest) into->newest = from->newest;
+}
+
+// Adds the rows of t that the listing showed with full metadata.
+void summary_add_table(struct summary *sum, const struct entry_table *t, struct totals *tot) {
+    for (int i = 0; i < t->count; i++) {
+        if ((t->flags[i] & ENTRY_STALE) || (t->stat_mask[i] & SUMMARY_STATX) != SUMMARY_STATX)
+            continue;
+        int dir = S_ISDIR(t->mode[i]);
+        if (!dir && t->nlink[i] > 1 && !inode_set_add(&sum->seen, t->dev[i], t->ino[i])) continue;
+        tot->size += t->size[i];
+        tot->blocks += t->blocks[i];
+        tot->files += !dir;
+        if (t->mtime[i] > tot->newest) tot->newest = t->mtime[i];
+    }
+}
+
+void summary_line(struct summary *sum, const char *path, const struct totals *tot,
+                  const struct ls_options *opts) {
+    struct outbuf *ob = &sum->lines;
+    char newest[32] = "-";
+    time_t mtime = tot->newest;
+    struct tm tm;
+    if (tot->newest && localtime_r(&mtime, &tm)) strftime(newest, sizeof(newest), "%Y-%m-%d %H:%M:%S", &tm);
+
+    if (opts->format == FORMAT_NDJSON) {
+        out_str(ob, "{");
+        json_name(ob, "path", path);
+        json_field(ob, ",\"summary\":{\"size\":", tot->size);
+        json_field(ob, ",\"blocks\":", tot->blocks);
+        json_field(ob, ",\"files\":", tot->files);
+        json_field(ob, ",\"newest\":", tot->newest);
+        out_str(ob, "}}\n");
+        return;
+    }
+    char blocks[32], size[32];
+    format_blocks(tot->blocks, opts, blocks, sizeof(blocks));
+    format_size(tot->size, opts, size, sizeof(size));
+    out_printf(ob, "%s\t%s\t%lld\t%s\t", blocks, size, tot->files, newest);
+    out_str(ob, path);
+    out_str(ob, "\n");
+}
+
+// Appends the collected lines after the listing of an operand.
+void summary_finish(struct summary *sum, const struct ls_options *opts) {
+    if (opts->format == FORMAT_TEXT)
+        out_printf(&out, "\nsummary (%s, files, newest mtime, directory):\n",
+                   opts->human_sizes ? "allocated, size" : "1K blocks, bytes");
+    out_write(&out, sum->lines.buf, sum->lines.len);
+    free(sum->lines.buf);
+    free(sum->seen.keys);
+}
+
+// ----------------- RECURSIVE LS -----------------
+int wants_descend(const char *name, const struct ls_options *opts) {
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+    return !list_matches(&opts->prune, name, strlen(name));
+}
+
+// JSON output in directory order (-U): each entry is written as soon as
+// it is read, and only the names of subdirectories to visit are kept.
+void stream_json(const char *path, const struct ls_options *opts, int depth) {
+    DIR *d = opendir(path);
+    if (!d) { perror("opendir"); return; }
+
+    int recurse = opts->recursive_flag && (opts->max_depth < 0 || depth < opts->max_depth);
+    unsigned int pmask = predicate_mask(&opts->pred);
+    struct entry_table subdirs = { 0 };
+    struct entry_table e = { 0 };        // one row, reused for every entry
+    struct dirent *entry;
+
+    while ((entry = readdir(d)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        int wanted = name_wanted(entry->d_name, len, opts);
+        if (!wanted) continue;
+
+        table_reset(&e);
+        if (table_add(&e, entry->d_name, len, entry->d_type) == -1) break;
+        if (wanted == NAME_SHOWN && row_matches(dirfd(d), &e, 0, &opts->pred, pmask) &&
+            stat_row_at(dirfd(d), entry->d_name, &e, 0, STATX_BASIC_STATS) == 0) {
+            struct stat st;
+            row_to_stat(&e, 0, &st);
+            json_entry(&out, opts->format, path, entry->d_name, &st);
+        }
+
+        if (!recurse || !wants_descend(entry->d_name, opts)) continue;
+        if (e.d_type[0] == DT_UNKNOWN && stat_row_at(dirfd(d), entry->d_name, &e, 0, STATX_TYPE) == 0)
+            e.d_type[0] = IFTODT(e.mode[0]);
+        if (e.d_type[0] != DT_DIR) continue;
+
+        if (table_add(&subdirs, entry->d_name, len, DT_DIR) == -1) break;
+    }
+    closedir(d);
+    table_free(&e);
+
+    for (int i = 0; i < subdirs.count; i++) {
+        char fullpath[1024];
+        join_path(fullpath, sizeof(fullpath), path, entry_name(&subdirs, i));
+        stream_json(fullpath, opts, depth + 1);
+    }
+    table_free(&subdirs);
+}
+
+// Bounded max-heap of the rows with the k smallest names, used to pick
+// the first screen in O(n log k) instead of sorting all n names first.
+void heap_sift_down(const struct entry_table *t, int *heap, int n, int i) {
+    for (;;) {
+        int largest = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && strcmp(entry_name(t, heap[l]), entry_name(t, heap[largest])) > 0) largest = l;
+        if (r < n && strcmp(entry_name(t, heap[r]), entry_name(t, heap[largest])) > 0) largest = r;
+        if (largest == i) return;
+        int tmp = heap[i];
+        heap[i] = heap[largest];
+        heap[largest] = tmp;
+        i = largest;
+    }
+}
+
+// On a terminal, -l and -1: select the first screenful of the sorted
+// listing right after the directory is read, print it and flush, and
+// only then sort and print the rest. The output is the same as without
+// a terminal. -l pads every row to widths measured over all of them and
+// starts with the total, so every row is stat'ed first; -1 rows share
+// no widths, so only the first screen is stat'ed (for color) before it
+// is shown.
+void ls_first_screen(const char *path, const struct ls_options *opts) {
+    struct ls_options scan_opts = *opts;
+    scan_opts.unsorted = 1;
+    struct entry_table t;
+    int count;
+    size_t longest;
+    if (gather_filenames(path, &scan_opts, &t, &count, &longest) == -1) return;
+
+    int k = get_terminal_height() - 3;     // header, total and prompt
+    if (k < 1) k = 1;
+    int *heap = count > k ? malloc(count * sizeof(*heap)) : NULL;
+    if (!heap) {
+        table_sort(&t);
+        if (count > 0) display_entries(path, &t, longest, opts, 0);
+        table_free(&t);
+        return;
+    }
+
+    for (int i = 0; i < k; i++) heap[i] = i;
+    for (int i = k / 2 - 1; i >= 0; i--) heap_sift_down(&t, heap, k, i);
+    for (int i = k; i < count; i++) {
+        if (strcmp(entry_name(&t, i), entry_name(&t, heap[0])) >= 0) continue;
+        heap[0] = i;
+        heap_sift_down(&t, heap, k, 0);
+    }
+    // Pop the heap largest-first into the back of its own array.
+    for (int n = k - 1; n > 0; n--) {
+        int tmp = heap[0];
+        heap[0] = heap[n];
+        heap[n] = tmp;
+        heap_sift_down(&t, heap, n, 0);
+    }
+
+    struct layout lay;
+    out_printf(&out, "%s:\n", path);
+    if (opts->long_format) {
+        measure_entries(path, &t, opts, &lay);
+        print_total(&lay, opts);
+        opts->render_rows(&t, heap, k, opts, &lay);
+        out_flush(&out);
+
+        // The first k rows of the sorted table are the ones just shown.
+        table_sort(&t);
+        for (int i = k; i < count; i++) heap[i - k] = i;
+        opts->render_rows(&t, heap, count - k, opts, &lay);
+    } else {
+        struct entry_table part;
+        if (table_copy(&t, heap, k, &part) == 0) {
+            measure_entries(path, &part, opts, &lay);
+            opts->render(&part, longest, opts, &lay);
+            table_free(&part);
+        }
+        out_flush(&out);
+
+        char *shown = calloc(count, 1);
+        if (shown) {
+            for (int i = 0; i < k; i++) shown[heap[i]] = 1;
+            for (int i = 0, n = 0; i < count; i++)
+                if (!shown[i]) heap[n++] = i;
+        }
+        if (shown && table_copy(&t, heap, count - k, &part) == 0) {
+            table_sort(&part);
+            measure_entries(path, &part, opts, &lay);
+            opts->render(&part, longest, opts, &lay);
+            table_free(&part);
+        }
+        free(shown);
+    }
+
+    free(heap);
+    table_free(&t);
+}
+
+// --limit/--after/--offset: one page of the sorted listing. The
+// directory is read once and only the offset + limit smallest names
+// after the cursor are kept, in the bounded max-heap ls_first_screen
+// uses, so a page costs O(n log k) time and O(k) memory however large
+// the directory is. When entries follow the page, the last name shown
+// is printed as the cursor for the next call.
+void ls_page(const char *path, const struct ls_options *opts) {
+    DIR *d = opendir(path);
+    if (!d) { perror("opendir"); return; }
+
+    int k = opts->page_limit ? (int)(opts->page_offset + opts->page_limit) : INT_MAX;
+    unsigned int pmask = predicate_mask(&opts->pred);
+    struct entry_table t = { 0 };
+    struct entry_table e = { 0 };        // one row, for predicates
+    int *heap = NULL;                    // set once t holds k rows
+    int more = 0;                        // some entry sorts after the page
+    struct dirent *entry;
+
+    while ((entry = readdir(d)) != NULL) {
+        const char *name = entry->d_name;
+        size_t len = strlen(name);
+        if (!name_wanted(name, len, opts)) continue;
+        if (opts->page_after && strcmp(name, opts->page_after) <= 0) continue;
+
+        int beyond = heap && strcmp(name, entry_name(&t, heap[0])) >= 0;
+        if (beyond && more) continue;
+        if (pmask) {
+            table_reset(&e);
+            if (table_add(&e, name, len, entry->d_type) == -1) break;
+            if (!row_matches(dirfd(d), &e, 0, &opts->pred, pmask)) continue;
+        }
+        if (beyond) {
+            more = 1;
+            continue;
+        }
+
+        if (!heap) {
+            if (table_add(&t, name, len, entry->d_type) == -1) break;
+            if (t.count < k) continue;
+            heap = malloc(k * sizeof(*heap));
+            if (!heap) { perror("malloc"); break; }
+            for (int i = 0; i < k; i++) heap[i] = i;
+            for (int i = k / 2 - 1; i >= 0; i--) heap_sift_down(&t, heap, k, i);
+            continue;
+        }
+        more = 1;
+        if (table_replace(&t, heap[0], name, len, entry->d_type) == -1) break;
+        heap_sift_down(&t, heap, k, 0);
+    }
+    closedir(d);
+    table_free(&e);
+    free(heap);
+
+    // The first offset rows are skipped; the rest are the page.
+    table_sort(&t);
+    int first = opts->page_offset < t.count ? (int)opts->page_offset : t.count;
+    int n = t.count - first;
+    int *rows = malloc((n ? n : 1) * sizeof(*rows));
+    struct entry_table page;
+    if (!rows) perror("malloc");
+    if (rows && n > 0) {
+        size_t longest = 0;
+        for (int i = 0; i < n; i++) {
+            rows[i] = first + i;
+            if (t.name_len[first + i] > longest) longest = t.name_len[first + i];
+        }
+        if (table_copy(&t, rows, n, &page) == 0) {
+            display_entries(path, &page, longest, opts, 0);
+            table_free(&page);
+        }
+    }
+    free(rows);
+
+    if (more && n > 0) {
+        const char *cursor = entry_name(&t, t.count - 1);
+        if (opts->format == FORMAT_TEXT) {
+            out_str(&out, "next: ");
+            out_str(&out, cursor);
+            out_str(&out, "\n");
+        } else {
+            if (opts->format == FORMAT_JSON) out_str(&out, out.records ? ",\n" : "\n");
+            out.records++;
+            out_str(&out, "{");
+            json_name(&out, "next", cursor);
+            out_str(&out, opts->format == FORMAT_NDJSON ? "}\n" : "}");
+        }
+    }
+    table_free(&t);
+}
+
+// Lists path (and with -R its subdirectories). With sum set, the totals
+// of everything listed beneath path are added to *tot and a summary
+// line is recorded for path once its subtree is done.
+void do_ls(const char *path, const struct ls_options *opts, int depth,
+           struct summary *sum, struct totals *tot) {
+    if (depth == 0 && opts->first_screen) {
+        ls_first_screen(path, opts);
+        return;
+    }
+
+    struct entry_table t;
+    int count;
+    size_t longest;
+    if (gather_filenames(path, opts, &t, &count, &longest) == -1) return;
+    struct totals here = { 0 };
+
+    // With predicates active some entries are only kept for recursion;
+    // hand the display functions a table of just the matches.
+    if (count == t.count) {
+        if (count > 0) display_entries(path, &t, longest, opts, depth);
+        if (sum) summary_add_table(sum, &t, &here);
+    } else if (count > 0) {
+        int *rows = malloc(count * sizeof(*rows));
+        struct entry_table shown;
+        if (rows) {
+            for (int i = 0, j = 0; i < t.count; i++)
+                if (t.flags[i] & ENTRY_MATCHED) rows[j++] = i;
+            if (table_copy(&t, rows, count, &shown) == 0) {
+                display_entries(path, &shown, longest, opts, depth);
+                if (sum) summary_add_table(sum, &shown, &here);
+                table_free(&shown);
+            }
+        }
+        free(rows);
+    }
+
+    // Depth and prune checks come before any stat so that skipped
+    // subtrees are never stat'ed or opened.
+    if (opts->recursive_flag && (opts->max_depth < 0 || depth < opts->max_depth)) {
+        for (int i = 0; i < t.count; i++) {
+            const char *name = entry_name(&t, i);
+            if (!wants_descend(name, opts)) continue;
+            if (!row_descends(path, &t, i)) continue;
+
+            char fullpath[1024];
+            join_path(fullpath, sizeof(fullpath), path, name);
+            do_ls(fullpath, opts, depth + 1, sum, &here);
+        }
+    }
+
+    if (sum) {
+        summary_line(sum, path, &here, opts);
+        totals_add(tot, &here);
+    }
+    table_free(&t);
+}
+
+// Visits every matching entry with full metadata, one directory at a
+// time in the order -R prints them: a directory's entries (sorted unless
+// -U), then each of its subdirectories in turn. With sorted directories
+// this is path order with '/' ranking below every other byte.
+typedef void (*walk_fn)(void *ctx, const char *dir, int first, struct entry_table *t, int i);
+
+void walk_tree(const char *path, const struct ls_options *opts, int depth, walk_fn fn, void *ctx) {
+    struct entry_table t;
+    int count;
+    size_t longest;
+    if (gather_filenames(path, opts, &t, &count, &longest) == -1) return;
+
+    int first = 1;
+    for (int i = 0; i < t.count; i++) {
+        if ((t.flags[i] & ENTRY_MATCHED) && stat_row(path, &t, i, STATX_BASIC_STATS) == 0) {
+            fn(ctx, path, first, &t, i);
+            first = 0;
+        }
+    }
+
+    if (opts->recursive_flag && (opts->max_depth < 0 || depth < opts->max_depth)) {
+        for (int i = 0; i < t.count; i++) {
+            if (!wants_descend(entry_name(&t, i), opts) || !row_descends(path, &t, i))
+                continue;
+            char fullpath[1024];
+            join_path(fullpath, sizeof(fullpath), path, entry_name(&t, i));
+            walk_tree(fullpath, opts, depth + 1, fn, ctx);
+        }
+    }
+
+    table_free(&t);
+}
+
+// -T: the tree below a directory drawn with box-drawing prefixes, depth
+// first and streamed as it goes. Besides the tables of the directories
+// on the current path, only one bit per level is kept: whether that
+// ancestor still has siblings to print, which decides between "│   "
+// and "    " in the prefix of everything below it.
+struct tree_walk {
+    uint64_t *more;              // bit d: the ancestor at depth d has more siblings
+    int words;
+    long dirs;
+    long files;
+};
+
+int tree_more(const struct tree_walk *w, int depth) {
+    return depth / 64 < w->words && (w->more[depth / 64] >> (depth % 64) & 1);
+}
+
+int tree_set_more(struct tree_walk *w, int depth, int more) {
+    if (depth / 64 >= w->words) {
+        uint64_t *grown = realloc(w->more, (depth / 64 + 1) * sizeof(*grown));
+        if (!grown) { perror("realloc"); return -1; }
+        memset(grown + w->words, 0, (depth / 64 + 1 - w->words) * sizeof(*grown));
+        w->more = grown;
+        w->words = depth / 64 + 1;
+    }
+    if (more) w->more[depth / 64] |= 1ull << (depth % 64);
+    else w->more[depth / 64] &= ~(1ull << (depth % 64));
+    return 0;
+}
+
+void tree_dir(const char *path, const struct ls_options *opts, int depth, struct tree_walk *w) {
+    struct entry_table t;
+    int count;
+    size_t longest;
+    if (gather_filenames(path, opts, &t, &count, &longest) == -1) return;
+
+    struct layout lay;
+    measure_entries(path, &t, opts, &lay);
+
+    // Entries that failed a predicate are still drawn if they are
+    // directories on the way to ones that did not. Like tree(1), -a
+    // does not draw "." and "..".
+    int recurse = opts->max_depth < 0 || depth < opts->max_depth;
+    int *rows = malloc((t.count ? t.count : 1) * sizeof(*rows));
+    if (!rows) { perror("malloc"); table_free(&t); return; }
+    int n = 0;
+    for (int i = 0; i < t.count; i++) {
+        const char *name = entry_name(&t, i);
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+        if (!row_shown(&t, i, &lay)) continue;
+        int dir = !(t.flags[i] & ENTRY_STALE) && row_descends(path, &t, i);
+        if ((t.flags[i] & ENTRY_MATCHED) || (dir && recurse && wants_descend(entry_name(&t, i), opts)))
+            rows[n++] = i;
+    }
+
+    for (int k = 0; k < n; k++) {
+        int i = rows[k];
+        int last = k == n - 1;
+        for (int d = 0; d < depth; d++) out_str(&out, tree_more(w, d) ? "│   " : "    ");
+        out_str(&out, last ? "└── " : "├── ");
+        print_prefix(&t, i, opts, &lay);
+        opts->print_name(&t, i);
+        out_str(&out, "\n");
+
+        int dir = !(t.flags[i] & ENTRY_STALE) && S_ISDIR(row_type(path, &t, i));
+        if (dir) w->dirs++;
+        else w->files++;
+        if (!dir || !recurse || !wants_descend(entry_name(&t, i), opts) || !row_descends(path, &t, i))
+            continue;
+        if (tree_set_more(w, depth, !last) == -1) continue;
+
+        char fullpath[1024];
+        join_path(fullpath, sizeof(fullpath), path, entry_name(&t, i));
+        tree_dir(fullpath, opts, depth + 1, w);
+    }
+
+    free(rows);
+    table_free(&t);
+}
+
+void ls_tree(const char *path, const struct ls_options *opts) {
+    struct tree_walk w = { 0 };
+    if (opts->color) print_colored(path, S_IFDIR);
+    else out_str(&out, path);
+    out_str(&out, "\n");
+    tree_dir(path, opts, 0, &w);
+    out_printf(&out, "\n%ld director%s, %ld file%s\n",
+               w.dirs, w.dirs == 1 ? "y" : "ies", w.files, w.files == 1 ? "" : "s");
+    free(w.more);
+}
+
+// Lists one directory operand into this thread's output buffer.
+void list_operand(const char *path, const struct ls_options *opts) {
+    if (opts->tree) {
+        ls_tree(path, opts);
+    } else if (opts->page_limit || opts->page_offset || opts->page_after) {
+        ls_page(path, opts);
+    } else if (opts->summarize) {
+        struct summary sum = { .lines = { .fd = -1 } };
+        struct totals tot = { 0 };
+        do_ls(path, opts, 0, &sum, &tot);
+        summary_finish(&sum, opts);
+    } else if (opts->format != FORMAT_TEXT && opts->unsorted) {
+        stream_json(path, opts, 0);
+    } else {
+        do_ls(path, opts, 0, NULL, NULL);
+    }
+}
+
+// A complete listing of one directory, as --serve sends it.
+void list_path(const char *path, const struct ls_options *opts) {
+    if (opts->format == FORMAT_JSON) out_str(&out, "[");
+    list_operand(path, opts);
+    if (opts->format == FORMAT_JSON) out_str(&out, "\n]\n");
+}
+
+// ---------------- COUNT -----------------
+// --count tallies entries straight from getdents64 buffers: no names
+// are copied, nothing is sorted, and an entry is stat'ed only when the
+// filesystem does not report its type (or a predicate needs metadata).
+// Buffers are allocated once per depth and reused.
+struct count_walk {
+    const struct ls_options *opts;
+    unsigned int pmask;
+    struct entry_table e;        // one row, for predicates
+    char **bufs;                 // one per depth
+    int nbufs;
+    long long entries;
+    long long by_type[16];       // indexed by DT_*
+};
+
+// Counts the directory open at fd and, with -R, its subdirectories.
+// Closes fd.
+void count_dir(struct count_walk *w, int fd, const char *path, int depth) {
+    const struct ls_options *opts = w->opts;
+    if (depth >= w->nbufs) {
+        char **grown = realloc(w->bufs, (depth + 1) * sizeof(*grown));
+        if (grown) w->bufs = grown;
+        char *buf = grown ? malloc(COUNT_BUF_SIZE) : NULL;
+        if (!buf) { perror("malloc"); close(fd); return; }
+        w->bufs[w->nbufs++] = buf;
+    }
+    char *buf = w->bufs[depth];
+    int recurse = opts->recursive_flag && (opts->max_depth < 0 || depth < opts->max_depth);
+
+    ssize_t n;
+    while ((n = getdents64(fd, buf, COUNT_BUF_SIZE)) > 0) {
+        for (ssize_t off = 0; off < n; ) {
+            struct dirent64 *d = (struct dirent64 *)(buf + off);
+            off += d->d_reclen;
+            size_t len = strlen(d->d_name);
+            int wanted = name_wanted(d->d_name, len, opts);
+            if (!wanted) continue;
+
+            unsigned char type = d->d_type;
+            int matched = wanted == NAME_SHOWN;
+            if ((matched && w->pmask) || type == DT_UNKNOWN) {
+                table_reset(&w->e);
+                if (table_add(&w->e, d->d_name, len, type) == -1) continue;
+                matched = matched && row_matches(fd, &w->e, 0, &opts->pred, w->pmask);
+                if (type == DT_UNKNOWN && stat_row_at(fd, d->d_name, &w->e, 0, STATX_TYPE) == 0)
+                    type = IFTODT(w->e.mode[0]);
+            }
+            if (matched) {
+                w->entries++;
+                w->by_type[type & 15]++;
+            }
+
+            if (!recurse || type != DT_DIR || !wants_descend(d->d_name, opts)) continue;
+            int sub = openat(fd, d->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (sub == -1) {
+                fprintf(stderr, "ls: cannot open directory '%s/%s': %s\n", path, d->d_name, strerror(errno));
+                continue;
+            }
+            char fullpath[1024];
+            join_path(fullpath, sizeof(fullpath), path, d->d_name);
+            count_dir(w, sub, fullpath, depth + 1);
+        }
+    }
+    if (n == -1) perror("getdents64");
+    close(fd);
+}
+
+// Prints the totals for one operand: "PATH: N" and a line per type
+// present, or one JSON object.
+int count_path(const char *path, const struct ls_options *opts) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "ls: cannot open directory '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct count_walk w = { .opts = opts, .pmask = predicate_mask(&opts->pred) };
+    count_dir(&w, fd, path, 0);
+
+    if (opts->format == FORMAT_TEXT) {
+        out_printf(&out, "%s: %lld\n", path, w.entries);
+    } else {
+        if (opts->format == FORMAT_JSON) out_str(&out, out.records ? ",\n" : "\n");
+        out.records++;
+        out_str(&out, "{");
+        json_name(&out, "path", path);
+        json_field(&out, ",\"entries\":", w.entries);
+    }
+    for (int type = 0; type < 16; type++) {
+        if (!w.by_type[type]) continue;
+        const char *name = type == DT_UNKNOWN ? "unknown" : type_name(DTTOIF(type));
+        if (opts->format == FORMAT_TEXT) {
+            out_printf(&out, "  %-8s %lld\n", name, w.by_type[type]);
+        } else {
+            out_printf(&out, ",\"%s\":", name);
+            out_i64(&out, w.by_type[type]);
+        }
+    }
+    if (opts->format != FORMAT_TEXT) out_str(&out, opts->format == FORMAT_NDJSON ? "}\n" : "}");
+
+    for (int i = 0; i < w.nbufs; i++) free(w.bufs[i]);
+    free(w.bufs);
+    table_free(&w.e);
+    return 0;
+}
+
+int count_operands(char **paths, int n, const struct ls_options *opts) {
+    int status = 0;
+    if (opts->format == FORMAT_JSON) out_str(&out, "[");
+    for (int i = 0; i < n; i++)
+        if (count_path(paths[i], opts) == -1) status = -1;
+    if (opts->format == FORMAT_JSON) out_str(&out, "\n]\n");
+    return status;
+}
+
+// ---------------- ESTIMATE -----------------
+// --estimate sizes a tree too big to walk from random root-to-leaf
+// probes (Knuth's estimator). A probe reads one directory per level,
+// entering one of its subdirectories at random, and counts each
+// directory's entries once for every path it stands for: the product
+// of the fan-outs above it. Each probe is an unbiased guess; their mean
+// is reported with a 95% confidence interval from their spread.
+// Directories are read with gather_filenames and stat'ed for sizes once
+// and then kept, so later probes pay only for levels not seen yet. If
+// every directory gets read within the budget, the totals are exact.
+struct est_dir {
+    long entries;                // matching entries
+    long long bytes;             // apparent size of the matching regular files
+    int nsubs;
+    char **subs;                 // subdirectories a probe may enter
+    struct est_dir **children;   // NULL until first entered
+};
+
+// Sums of x and x^2 over probes, for the mean and its interval.
+struct est_sum {
+    double sum;
+    double sq;
+};
+
+struct estimate {
+    const struct ls_options *opts;
+    uint64_t rng;
+    long probes;
+    long dirs_read;
+    long unread;                 // subdirectory slots no probe has entered
+    struct est_sum entries;
+    struct est_sum bytes;
+    struct est_sum *depths;      // entries inside directories at each depth
+    int ndepths;
+};
+
+uint64_t est_random(struct estimate *e) {
+    e->rng ^= e->rng << 13;
+    e->rng ^= e->rng >> 7;
+    e->rng ^= e->rng << 17;
+    return e->rng;
+}
+
+void est_add(struct est_sum *s, double x) {
+    s->sum += x;
+    s->sq += x * x;
+}
+
+// Reads one directory. A directory that cannot be read counts as empty.
+struct est_dir *est_load(struct estimate *e, const char *path, int depth) {
+    const struct ls_options *opts = e->opts;
+    struct est_dir *d = calloc(1, sizeof(*d));
+    if (!d) { perror("calloc"); return NULL; }
+    e->dirs_read++;
+
+    struct entry_table t;
+    int count;
+    size_t longest;
+    if (gather_filenames(path, opts, &t, &count, &longest) == -1) return d;
+    d->entries = count;
+
+    unsigned int mask = STATX_TYPE | STATX_SIZE;
+    fetch_stats(path, &t, mask);
+    int recurse = opts->max_depth < 0 || depth < opts->max_depth;
+    for (int i = 0; i < t.count; i++) {
+        if ((t.flags[i] & ENTRY_MATCHED) && !(t.flags[i] & ENTRY_STALE) &&
+            stat_row(path, &t, i, mask) == 0 && S_ISREG(t.mode[i]))
+            d->bytes += t.size[i];
+    }
+    if (recurse) {
+        d->subs = malloc((t.count ? t.count : 1) * sizeof(*d->subs));
+        if (!d->subs) perror("malloc");
+        for (int i = 0; d->subs && i < t.count; i++) {
+            if ((t.flags[i] & ENTRY_STALE) || !wants_descend(entry_name(&t, i), opts) ||
+                !row_descends(path, &t, i))
+                continue;
+            if (!(d->subs[d->nsubs] = strdup(entry_name(&t, i)))) { perror("strdup"); break; }
+            d->nsubs++;
+        }
+        d->children = d->nsubs ? calloc(d->nsubs, sizeof(*d->children)) : NULL;
+        if (d->nsubs && !d->children) { perror("calloc"); d->nsubs = 0; }
+        e->unread += d->nsubs;
+    }
+    table_free(&t);
+    return d;
+}
+
+void est_free(struct est_dir *d) {
+    if (!d) return;
+    for (int k = 0; k < d->nsubs; k++) {
+        free(d->subs[k]);
+        est_free(d->children[k]);
+    }
+    free(d->subs);
+    free(d->children);
+    free(d);
+}
+
+// Makes room for depth in the per-depth sums.
+int est_depth(struct estimate *e, int depth) {
+    if (depth < e->ndepths) return 0;
+    struct est_sum *grown = realloc(e->depths, (depth + 1) * sizeof(*grown));
+    if (!grown) { perror("realloc"); return -1; }
+    memset(grown + e->ndepths, 0, (depth + 1 - e->ndepths) * sizeof(*grown));
+    e->depths = grown;
+    e->ndepths = depth + 1;
+    return 0;
+}
+
+// One probe down from root, whose path is in path (of size n); names
+// are appended to it on the way down and removed again.
+void est_probe(struct estimate *e, struct est_dir *root, char *path, size_t n) {
+    size_t base = strlen(path);
+    double weight = 1, entries = 0, bytes = 0;
+    struct est_dir *d = root;
+    for (int depth = 0; d; depth++) {
+        entries += weight * d->entries;
+        bytes += weight * d->bytes;
+        if (est_depth(e, depth) == 0) est_add(&e->depths[depth], weight * d->entries);
+        if (d->nsubs == 0) break;
+
+        int k = est_random(e) % d->nsubs;
+        size_t len = strlen(path);
+        snprintf(path + len, n - len, "/%s", d->subs[k]);
+        if (!d->children[k]) {
+            d->children[k] = est_load(e, path, depth + 1);
+            e->unread--;
+        }
+        weight *= d->nsubs;
+        d = d->children[k];
+    }
+    path[base] = '\0';
+    est_add(&e->entries, entries);
+    est_add(&e->bytes, bytes);
+    e->probes++;
+}
+
+// Once every directory has been read the totals are summed directly.
+void est_exact(struct estimate *e, const struct est_dir *d, int depth) {
+    est_add(&e->entries, d->entries);
+    est_add(&e->bytes, d->bytes);
+    if (est_depth(e, depth) == 0) est_add(&e->depths[depth], d->entries);
+    for (int k = 0; k < d->nsubs; k++)
+        if (d->children[k]) est_exact(e, d->children[k], depth + 1);
+}
+
+// Newton's method, so that one square root does not need libm.
+double est_sqrt(double v) {
+    if (v <= 0) return 0;
+    double r = v > 1 ? v : 1;
+    for (int i = 0; i < 100 && r * r - v > v * 1e-12; i++) r = (r + v / r) / 2;
+    return r;
+}
+
+// Half the width of the 95% interval around the mean of s over n
+// probes, or -1 with fewer than two.
+double est_margin(const struct est_sum *s, long n) {
+    if (n < 2) return -1;
+    double mean = s->sum / n;
+    return 1.96 * est_sqrt((s->sq - mean * s->sum) / (n - 1) / n);
+}
+
+// One quantity: "  NAME  VALUE ± MARGIN" or a JSON value and margin.
+// Exact totals are a single sample with no margin.
+void est_value(const char *name, const struct est_sum *s, long n, int exact, int size,
+               const struct ls_options *opts) {
+    double mean = s->sum / n;
+    double margin = exact ? 0 : est_margin(s, n);
+    char value[32], plus[32] = "?";
+    if (size && opts->human_sizes && opts->format == FORMAT_TEXT) {
+        human_size((long long)(mean + 0.5), value, sizeof(value));
+        if (margin >= 0) human_size((long long)(margin + 0.5), plus, sizeof(plus));
+    } else {
+        snprintf(value, sizeof(value), "%lld", (long long)(mean + 0.5));
+        if (margin >= 0) snprintf(plus, sizeof(plus), "%lld", (long long)(margin + 0.5));
+    }
+    if (opts->format == FORMAT_TEXT) {
+        out_printf(&out, "  %-8s %s ± %s\n", name, value, plus);
+        return;
+    }
+    out_printf(&out, "\"%s\":%s,\"%s_margin\":%s", name, value, name, margin >= 0 ? plus : "null");
+}
+
+// Probes the tree below path until budget_ms have passed or every
+// directory has been read, then prints the totals.
+int estimate_path(const char *path, const struct ls_options *opts, long budget_ms, uint64_t seed) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "ls: cannot open directory '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    closedir(dir);
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct estimate e = { .opts = opts, .rng = seed };
+    struct est_dir *root = est_load(&e, path, 0);
+    if (!root) return -1;
+
+    char probe_path[4096];
+    snprintf(probe_path, sizeof(probe_path), "%s", path);
+    long elapsed = 0;
+    while (e.unread > 0 && elapsed < budget_ms) {
+        est_probe(&e, root, probe_path, sizeof(probe_path));
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+    }
+    int exact = e.unread == 0;
+    long n = exact ? 1 : e.probes;
+    if (exact) {
+        e.entries = e.bytes = (struct est_sum){ 0 };
+        if (e.depths) memset(e.depths, 0, e.ndepths * sizeof(*e.depths));
+        est_exact(&e, root, 0);
+    }
+
+    if (opts->format == FORMAT_TEXT) {
+        if (exact) out_printf(&out, "%s: exact, %ld directories read\n", path, e.dirs_read);
+        else out_printf(&out, "%s: estimated from %ld probes, %ld directories read\n",
+                        path, e.probes, e.dirs_read);
+    } else {
+        if (opts->format == FORMAT_JSON) out_str(&out, out.records ? ",\n" : "\n");
+        out.records++;
+        out_str(&out, "{");
+        json_name(&out, "path", path);
+        out_printf(&out, ",\"exact\":%s", exact ? "true" : "false");
+        json_field(&out, ",\"probes\":", e.probes);
+        json_field(&out, ",\"dirs_read\":", e.dirs_read);
+        out_str(&out, ",");
+    }
+    est_value("entries", &e.entries, n, exact, 0, opts);
+    if (opts->format != FORMAT_TEXT) out_str(&out, ",");
+    est_value("bytes", &e.bytes, n, exact, 1, opts);
+    if (opts->format != FORMAT_TEXT) out_str(&out, ",\"depths\":[");
+    for (int depth = 0; depth < e.ndepths; depth++) {
+        char name[32];
+        snprintf(name, sizeof(name), "depth %d", depth);
+        if (opts->format == FORMAT_TEXT) {
+            est_value(name, &e.depths[depth], n, exact, 0, opts);
+            continue;
+        }
+        out_str(&out, depth ? ",{" : "{");
+        est_value("entries", &e.depths[depth], n, exact, 0, opts);
+        out_str(&out, "}");
+    }
+    if (opts->format != FORMAT_TEXT) out_str(&out, opts->format == FORMAT_NDJSON ? "]}\n" : "]}");
+
+    est_free(root);
+    free(e.depths);
+    return 0;
+}
+
+// Test hook: LS_ESTIMATE_SEED=N makes the probes repeatable.
+int estimate_operands(char **paths, int n, const struct ls_options *opts, long budget_ms) {
+    const char *env = getenv("LS_ESTIMATE_SEED");
+    uint64_t seed = env ? strtoull(env, NULL, 10) : (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    // The whole tree is estimated, so entries that fail a filter are
+    // still entered when they are directories, as under -R.
+    struct ls_options tree_opts = *opts;
+    tree_opts.recursive_flag = 1;
+    int status = 0;
+    if (opts->format == FORMAT_JSON) out_str(&out, "[");
+    for (int i = 0; i < n; i++) {
+        // xorshift never leaves zero; mixing keeps nearby seeds apart.
+        uint64_t rng = (seed + i) * 0x9E3779B97F4A7C15ull + 1;
+        if (estimate_path(paths[i], &tree_opts, budget_ms, rng) == -1) status = -1;
+    }
+    if (opts->format == FORMAT_JSON) out_str(&out, "\n]\n");
+    return status;
+}
+
+// ---------------- WATCH -----------------
+// --watch lists the directory once, then keeps the entry table in step
+// with inotify events: only entries named by an event are stat'ed again,
+// and the view is redrawn from the table.
+struct watch_table {
+    struct entry_table t;
+    int sorted;
+};
+
+// Row of name, or -(insertion point) - 1 if absent.
+int watch_find(const struct watch_table *w, const char *name) {
+    const struct entry_table *t = &w->t;
+    if (!w->sorted) {
+        for (int i = 0; i < t->count; i++)
+            if (strcmp(entry_name(t, i), name) == 0) return i;
+        return -t->count - 1;
+    }
+    int lo = 0, hi = t->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int c = strcmp(entry_name(t, mid), name);
+        if (c == 0) return mid;
+        if (c < 0) lo = mid + 1; else hi = mid;
+    }
+    return -lo - 1;
+}
+
+void watch_remove(struct watch_table *w, const char *name) {
+    int i = watch_find(w, name);
+    if (i >= 0) table_remove(&w->t, i);
+}
+
+// Re-reads one entry after an event: inserts, refreshes or drops it
+// depending on whether it still exists and still passes the filters.
+// The fresh row is added at the end, then moved or merged into place.
+void watch_update(struct watch_table *w, int dfd, const char *name, const struct ls_options *opts) {
+    size_t len = strlen(name);
+    if (!name_wanted(name, len, opts)) return;
+
+    struct entry_table *t = &w->t;
+    int row = table_add(t, name, len, DT_UNKNOWN);
+    if (row == -1) return;
+    if (stat_row_at(dfd, name, t, row, STATX_BASIC_STATS) == -1 ||
+        !row_matches(dfd, t, row, &opts->pred, predicate_mask(&opts->pred))) {
+        table_pop(t);
+        watch_remove(w, name);
+        return;
+    }
+    t->d_type[row] = IFTODT(t->mode[row]);
+    t->flags[row] = ENTRY_MATCHED;
+
+    t->count--;                  // search the rows that were there before
+    int i = watch_find(w, name);
+    t->count++;
+    if (i >= 0) {
+        table_copy_row(t, row, i);
+        t->count--;
+    } else {
+        table_move(t, row, -i - 1);
+    }
+}
+
+void watch_load(struct watch_table *w, const char *path, const struct ls_options *opts) {
+    table_free(&w->t);
+    int count;
+    size_t longest;
+    gather_filenames(path, opts, &w->t, &count, &longest);
+    w->sorted = !opts->unsorted;
+}
+
+void watch_render(struct watch_table *w, const char *path, const struct ls_options *opts) {
+    if (isatty(STDOUT_FILENO)) out_str(&out, "\033[H\033[2J");
+    size_t longest = 0;
+    for (int i = 0; i < w->t.count; i++)
+        if (w->t.name_len[i] > longest) longest = w->t.name_len[i];
+    if (w->t.count > 0)
+        display_entries(path, &w->t, longest, opts, 0);
+    if (!isatty(STDOUT_FILENO)) out_str(&out, "\n");
+    out_flush(&out);
+}
+
+int watch_dir(const char *path, const struct ls_options *ls_opts) {
+    // Only the named directory is watched; -R does not apply.
+    struct ls_options watch_opts = *ls_opts;
+    watch_opts.recursive_flag = 0;
+    const struct ls_options *opts = &watch_opts;
+
+    int dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd == -1) { perror(path); return -1; }
+    int ifd = inotify_init1(IN_CLOEXEC);
+    if (ifd == -1) { perror("inotify_init1"); close(dfd); return -1; }
+    uint32_t mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+    if (inotify_add_watch(ifd, path, mask) == -1) {
+        perror("inotify_add_watch");
+        close(ifd);
+        close(dfd);
+        return -1;
+    }
+
+    struct watch_table w = { 0 };
+    watch_load(&w, path, opts);
+    watch_render(&w, path, opts);
+
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int gone = 0, timeout = -1, dirty = 0;
+    while (!gone) {
+        struct pollfd pfd = { .fd = ifd, .events = POLLIN };
+        int ready = poll(&pfd, 1, timeout);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if (ready == 0) {
+            // Quiet for WATCH_SETTLE_MS: draw the accumulated changes.
+            if (dirty) watch_render(&w, path, opts);
+            dirty = 0;
+            timeout = -1;
+            continue;
+        }
+
+        ssize_t len = read(ifd, buf, sizeof(buf));
+        if (len <= 0) {
+            if (len == -1 && errno == EINTR) continue;
+            break;
+        }
+        for (char *p = buf; p < buf + len; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                watch_load(&w, path, opts);
+            } else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                gone = 1;
+            } else if (ev->len == 0) {
+                continue;
+            } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                watch_remove(&w, ev->name);
+            } else {
+                watch_update(&w, dfd, ev->name, opts);
+            }
+            dirty = 1;
+        }
+        timeout = WATCH_SETTLE_MS;
+    }
+    if (dirty) watch_render(&w, path, opts);
+
+    table_free(&w.t);
+    close(ifd);
+    close(dfd);
+    return 0;
+}
+
+// ---------------- SNAPSHOT -----------------
+// --format=bin layout, native byte order:
+//
+//   struct snap_header
+//   struct snap_record[record_count]   at records_offset
+//   NUL-terminated strings             at strings_offset
+//
+// Each record points at its name and at its directory's path in the
+// string table; a directory path is stored once for all its entries,
+// and a directory's records are contiguous. The string at offset 0 is
+// the path the snapshot was taken of. A symlink's record also points at
+// its target and says whether it dangled, so a snapshot is rendered
+// without looking at the tree. The header also records which entries
+// were selected (-a/-A, -L, --max-depth, the filters and predicates) so
+// that --diff selects the same ones from the tree; each name filter is
+// one string, a tag byte (see snap_add_filters) followed by the pattern.
+// Records are fixed-size and 8-byte aligned, so a reader can mmap the
+// file and index it directly.
+#define SNAP_MAGIC       "LSSNAP\0"
+#define SNAP_VERSION     3
+#define SNAP_BYTE_ORDER  0x01020304u
+#define SNAP_SORTED      0x1u     // names sorted within each directory
+#define SNAP_RECURSIVE   0x2u     // written with -R
+#define SNAP_FOLLOW      0x4u     // written with -L
+#define SNAP_MIN_SIZE    0x1u     // pred_flags: --larger-than
+#define SNAP_OWNER       0x2u     // pred_flags: --owner
+#define SNAP_NO_STRING   UINT64_MAX
+#define SNAP_DANGLING    0x1u     // record flag: symlink whose target is missing
+
+struct snap_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t record_size;
+    uint32_t flags;
+    uint64_t record_count;
+    uint64_t records_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    // Identity of the listed directory when the file is a cache entry
+    // (see DIRECTORY CACHE); zero in --format=bin exports.
+    uint64_t dir_dev;
+    uint64_t dir_ino;
+    int64_t dir_mtime_ns;
+    int64_t dir_ctime_ns;
+    // Entry selection of a --format=bin export; zero in cache entries.
+    uint32_t hidden;             // HIDDEN_*
+    int32_t max_depth;           // -1 = no limit
+    uint32_t type_mask;
+    uint32_t pred_flags;         // SNAP_MIN_SIZE, SNAP_OWNER
+    int64_t min_size;
+    int64_t newer_than;          // absolute mtime cutoffs, 0 = unset
+    int64_t older_than;
+    uint32_t owner;
+    uint32_t filter_count;
+    uint64_t filters_off;        // the first of filter_count strings
+};
+
+struct snap_record {
+    uint64_t ino;
+    uint64_t dev;
+    uint64_t size;
+    uint64_t blocks;
+    int64_t atime;
+    int64_t mtime;
+    int64_t ctime;
+    uint32_t mode;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t name_off;
+    uint64_t dir_off;
+    uint64_t target_off;         // symlink target, SNAP_NO_STRING if none
+    uint32_t flags;              // SNAP_DANGLING
+    uint32_t reserved;
+};
+
+// Records are streamed to stdout; strings are spooled to a temporary
+// file and appended at the end, then the header is rewritten in place.
+struct snap_writer {
+    FILE *strings;
+    uint64_t strings_size;
+    uint64_t record_count;
+};
+
+static struct snap_writer snap;
+
+uint64_t snap_add_string(const char *str) {
+    size_t len = strlen(str) + 1;
+    uint64_t off = snap.strings_size;
+    if (fwrite(str, 1, len, snap.strings) != len) { perror("fwrite"); exit(EXIT_FAILURE); }
+    snap.strings_size += len;
+    return off;
+}
+
+void snap_add_record(uint64_t dir_off, const char *name, const struct stat *st,
+                     const char *target, uint32_t flags) {
+    struct snap_record r = {
+        .ino = st->st_ino,
+        .dev = st->st_dev,
+        .size = st->st_size,
+        .blocks = st->st_blocks,
+        .atime = st->st_atime,
+        .mtime = st->st_mtime,
+        .ctime = st->st_ctime,
+        .mode = st->st_mode,
+        .nlink = st->st_nlink,
+        .uid = st->st_uid,
+        .gid = st->st_gid,
+        .name_off = snap_add_string(name),
+        .dir_off = dir_off,
+        .target_off = target ? snap_add_string(target) : SNAP_NO_STRING,
+        .flags = flags,
+    };
+    out_write(&out, (const char *)&r, sizeof(r));
+    snap.record_count++;
+}
+
+// Saves the patterns of list, tagged glob_tag or regex_tag, as given on
+// the command line (a suffix pattern is kept without its '*').
+uint32_t snap_add_filters(const struct filter_list *list, char glob_tag, char regex_tag) {
+    for (int i = 0; i < list->count; i++) {
+        const struct name_filter *f = &list->items[i];
+        int n = fprintf(snap.strings, "%c%s%s%c", f->kind == FILTER_REGEX ? regex_tag : glob_tag,
+                        f->kind == FILTER_SUFFIX ? "*" : "", f->pattern, '\0');
+        if (n < 0) { perror("fprintf"); exit(EXIT_FAILURE); }
+        snap.strings_size += n;
+    }
+    return list->count;
+}
+
+// walk_tree() visitor. The root path was stored first, at offset 0;
+// every other directory's path is added with its first record.
+struct snapshot_ctx {
+    const char *root;
+    uint64_t dir_off;
+};
+
+void snapshot_entry(void *ctx, const char *dir, int first, struct entry_table *t, int i) {
+    struct snapshot_ctx *sc = ctx;
+    if (first) sc->dir_off = dir == sc->root ? 0 : snap_add_string(dir);
+    struct stat st;
+    row_to_stat(t, i, &st);
+    if (!S_ISLNK(st.st_mode)) {
+        snap_add_record(sc->dir_off, entry_name(t, i), &st, NULL, 0);
+        return;
+    }
+
+    char fullpath[1024], target[PATH_MAX];
+    struct stat target_st;
+    join_path(fullpath, sizeof(fullpath), dir, entry_name(t, i));
+    ssize_t n = readlink(fullpath, target, sizeof(target) - 1);
+    if (n >= 0) target[n] = '\0';
+    uint32_t flags = stat(fullpath, &target_st) == -1 ? SNAP_DANGLING : 0;
+    snap_add_record(sc->dir_off, entry_name(t, i), &st, n >= 0 ? target : NULL, flags);
+}
+
+int write_snapshot(const char *path, const struct ls_options *opts) {
+    struct stat st;
+    if (fstat(out.fd, &st) == -1 || !S_ISREG(st.st_mode) || lseek(out.fd, 0, SEEK_CUR) != 0) {
+        fprintf(stderr, "--format=bin: standard output must be redirected to a new regular file\n");
+        return -1;
+    }
+    snap.strings = tmpfile();
+    if (!snap.strings) { perror("tmpfile"); return -1; }
+
+    struct snap_header h = { .magic = SNAP_MAGIC };
+    out_write(&out, (const char *)&h, sizeof(h));
+    struct snapshot_ctx sc = { .root = path, .dir_off = snap_add_string(path) };
+    h.filters_off = snap.strings_size;
+    h.filter_count = snap_add_filters(&opts->prune, 'p', 'p') +
+                     snap_add_filters(&opts->ignore, 'i', 'I') +
+                     snap_add_filters(&opts->include, 'n', 'N');
+    walk_tree(path, opts, 0, snapshot_entry, &sc);
+
+    h.version = SNAP_VERSION;
+    h.byte_order = SNAP_BYTE_ORDER;
+    h.record_size = sizeof(struct snap_record);
+    h.flags = (opts->unsorted ? 0 : SNAP_SORTED) | (opts->recursive_flag ? SNAP_RECURSIVE : 0) |
+              (stat_follow ? SNAP_FOLLOW : 0);
+    h.hidden = opts->show_hidden;
+    h.max_depth = opts->max_depth;
+    h.type_mask = opts->pred.type_mask;
+    h.pred_flags = (opts->pred.has_min_size ? SNAP_MIN_SIZE : 0) | (opts->pred.has_owner ? SNAP_OWNER : 0);
+    h.min_size = opts->pred.min_size;
+    h.newer_than = opts->pred.newer_than;
+    h.older_than = opts->pred.older_than;
+    h.owner = opts->pred.owner;
+    h.record_count = snap.record_count;
+    h.records_offset = sizeof(h);
+    h.strings_offset = sizeof(h) + snap.record_count * sizeof(struct snap_record);
+    h.strings_size = snap.strings_size;
+
+    rewind(snap.strings);
+    char chunk[OUTBUF_SIZE];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), snap.strings)) > 0)
+        out_write(&out, chunk, n);
+    fclose(snap.strings);
+    out_flush(&out);
+
+    if (pwrite(out.fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) { perror("pwrite"); return -1; }
+    return 0;
+}
+
+// Whether the size bytes at h are a snapshot of this version whose
+// offsets all stay inside them. Each bound is checked against what is
+// left of the file, so no sum can overflow.
+int snap_header_valid(const struct snap_header *h, size_t size) {
+    return size >= sizeof(*h) &&
+           memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic)) == 0 &&
+           h->version == SNAP_VERSION && h->byte_order == SNAP_BYTE_ORDER &&
+           h->record_size == sizeof(struct snap_record) &&
+           h->records_offset % 8 == 0 && h->records_offset <= size &&
+           h->record_count <= (size - h->records_offset) / sizeof(struct snap_record) &&
+           h->strings_offset <= size && h->strings_size <= size - h->strings_offset &&
+           (h->strings_size == 0 || ((const char *)h)[h->strings_offset + h->strings_size - 1] == '\0');
+}
+
+// Maps a snapshot and checks that every offset stays inside the file.
+const struct snap_header *map_snapshot(const char *file, size_t *map_size) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) { perror(file); return NULL; }
+    struct stat st;
+    if (fstat(fd, &st) == -1) { perror(file); close(fd); return NULL; }
+
+    size_t size = st.st_size;
+    void *map = size >= sizeof(struct snap_header)
+                ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) { fprintf(stderr, "%s: not a snapshot\n", file); return NULL; }
+
+    const struct snap_header *h = map;
+    if (!snap_header_valid(h, size)) {
+        fprintf(stderr, "%s: not a valid snapshot (version %u)\n", file, SNAP_VERSION);
+        munmap(map, size);
+        return NULL;
+    }
+    *map_size = size;
+    return h;
+}
+
+const char *snap_string(const struct snap_header *h, uint64_t off) {
+    if (off >= h->strings_size) return "?";
+    return (const char *)h + h->strings_offset + off;
+}
+
+void snap_to_stat(const struct snap_record *r, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_ino = r->ino;
+    st->st_dev = r->dev;
+    st->st_size = r->size;
+    st->st_blocks = r->blocks;
+    st->st_atime = r->atime;
+    st->st_mtime = r->mtime;
+    st->st_ctime = r->ctime;
+    st->st_mode = r->mode;
+    st->st_nlink = r->nlink;
+    st->st_uid = r->uid;
+    st->st_gid = r->gid;
+}
+
+// The saved target and dangling state of a symlink record, if any.
+int snap_set_target(const struct snap_header *h, const struct snap_record *r,
+                    struct entry_table *t, int i) {
+    if (r->flags & SNAP_DANGLING) t->flags[i] |= ENTRY_DANGLING;
+    if (r->target_off == SNAP_NO_STRING) return 0;
+    return table_set_target(t, i, snap_string(h, r->target_off));
+}
+
+// --read-snapshot: renders each directory's run of records through the
+// regular display functions, with metadata taken from the file.
+int read_snapshot(const char *file, const struct ls_options *opts) {
+    size_t map_size;
+    const struct snap_header *h = map_snapshot(file, &map_size);
+    if (!h) return -1;
+
+    const struct snap_record *recs = (const void *)((const char *)h + h->records_offset);
+    struct entry_table t = { 0 };
+    int groups = 0, status = 0;
+
+    for (uint64_t i = 0; i < h->record_count && status == 0; ) {
+        uint64_t dir_off = recs[i].dir_off;
+        size_t longest = 0;
+        table_reset(&t);
+        t.saved = 1;
+        for (; i < h->record_count && recs[i].dir_off == dir_off; i++) {
+            const char *name = snap_string(h, recs[i].name_off);
+            size_t len = strlen(name);
+            struct stat st;
+            snap_to_stat(&recs[i], &st);
+            int row = table_add(&t, name, len, IFTODT(st.st_mode));
+            if (row == -1 || row_set_stat(&t, row, &st, STATX_BASIC_STATS) == -1 ||
+                snap_set_target(h, &recs[i], &t, row) == -1) { status = -1; break; }
+            t.flags[row] |= ENTRY_MATCHED;
+            if (len > longest) longest = len;
+        }
+        if (status == 0) display_entries(snap_string(h, dir_off), &t, longest, opts, groups++);
+    }
+
+    table_free(&t);
+    munmap((void *)h, map_size);
+    return status;
+}
+
+// ---------------- DIFF -----------------
+// --diff SNAPSHOT walks the tree in the snapshot's own order and merges
+// the two sorted streams in one pass, printing "+ path" for new entries,
+// "- path" for removed ones and "~ path (fields)" for changed ones.
+// Paths are compared relative to each side's root.
+
+// strcmp with '/' ranking just above '\0', the order walk_tree() visits
+// directories in.
+int path_cmp(const char *a, const char *b) {
+    for (;; a++, b++) {
+        int ca = *a == '/' ? 1 : *a ? (unsigned char)*a + 1 : 0;
+        int cb = *b == '/' ? 1 : *b ? (unsigned char)*b + 1 : 0;
+        if (ca != cb) return ca - cb;
+        if (ca == 0) return 0;
+    }
+}
+
+struct diff_state {
+    const struct snap_header *h;
+    const struct snap_record *recs;
+    uint64_t *order;             // sorted record index, NULL if already in order
+    uint64_t next;
+    size_t snap_root_len;
+    const char *root;            // current side
+    size_t root_len;
+    long added, removed, modified;
+};
+
+const struct snap_record *diff_peek(struct diff_state *ds) {
+    if (ds->next >= ds->h->record_count) return NULL;
+    return &ds->recs[ds->order ? ds->order[ds->next] : ds->next];
+}
+
+const char *snap_rel_dir(const struct diff_state *ds, const struct snap_record *r) {
+    const char *dir = snap_string(ds->h, r->dir_off);
+    return strlen(dir) >= ds->snap_root_len ? dir + ds->snap_root_len : dir;
+}
+
+int diff_key_cmp(const char *dir_a, const char *name_a, const char *dir_b, const char *name_b) {
+    int c = path_cmp(dir_a, dir_b);
+    return c ? c : strcmp(name_a, name_b);
+}
+
+static const struct diff_state *sort_state;
+
+int compare_snap_records(const void *a, const void *b) {
+    const struct snap_record *ra = &sort_state->recs[*(const uint64_t *)a];
+    const struct snap_record *rb = &sort_state->recs[*(const uint64_t *)b];
+    return diff_key_cmp(snap_rel_dir(sort_state, ra), snap_string(sort_state->h, ra->name_off),
+                        snap_rel_dir(sort_state, rb), snap_string(sort_state->h, rb->name_off));
+}
+
+void diff_print(char tag, const char *root, const char *rel_dir, const char *name, const char *detail) {
+    out_printf(&out, "%c %s%s/%s%s\n", tag, root, rel_dir, name, detail);
+}
+
+void diff_removed(struct diff_state *ds, const struct snap_record *r) {
+    diff_print('-', ds->root, snap_rel_dir(ds, r), snap_string(ds->h, r->name_off), "");
+    ds->removed++;
+}
+
+void diff_compare(struct diff_state *ds, const char *rel_dir, const char *name,
+                  const struct snap_record *r, const struct stat *st) {
+    char detail[64] = "";
+    size_t n = 0;
+    #define DIFF_FIELD(cond, label) \
+        if (cond) n += snprintf(detail + n, sizeof(detail) - n, "%s" label, n ? "," : " (")
+    DIFF_FIELD((r->mode & S_IFMT) != (st->st_mode & S_IFMT), "type");
+    DIFF_FIELD((r->mode & ~S_IFMT) != (st->st_mode & ~S_IFMT), "mode");
+    DIFF_FIELD(r->size != (uint64_t)st->st_size, "size");
+    DIFF_FIELD(r->mtime != st->st_mtime, "mtime");
+    DIFF_FIELD(r->uid != st->st_uid, "uid");
+    DIFF_FIELD(r->gid != st->st_gid, "gid");
+    #undef DIFF_FIELD
+    if (n == 0) return;
+    snprintf(detail + n, sizeof(detail) - n, ")");
+    diff_print('~', ds->root, rel_dir, name, detail);
+    ds->modified++;
+}
+
+// walk_tree() visitor for the current side.
+void diff_entry(void *ctx, const char *dir, int first, struct entry_table *t, int i) {
+    (void)first;
+    struct diff_state *ds = ctx;
+    const char *rel_dir = dir + ds->root_len;
+    const char *name = entry_name(t, i);
+
+    const struct snap_record *r;
+    while ((r = diff_peek(ds)) != NULL) {
+        int c = diff_key_cmp(snap_rel_dir(ds, r), snap_string(ds->h, r->name_off), rel_dir, name);
+        if (c > 0) break;
+        ds->next++;
+        if (c < 0) {
+            diff_removed(ds, r);
+        } else {
+            struct stat st;
+            row_to_stat(t, i, &st);
+            diff_compare(ds, rel_dir, name, r, &st);
+            return;
+        }
+    }
+    diff_print('+', ds->root, rel_dir, name, "");
+    ds->added++;
+}
+
+// Replaces the entry selection in opts with the one saved in h. The
+// patterns point into the mapping.
+int snap_load_selection(const struct snap_header *h, struct ls_options *opts) {
+    if (h->hidden > HIDDEN_ALL) return -1;
+    opts->show_hidden = h->hidden;
+    opts->max_depth = h->max_depth;
+    opts->pred = (struct predicates){
+        .type_mask = h->type_mask,
+        .has_min_size = (h->pred_flags & SNAP_MIN_SIZE) != 0,
+        .min_size = h->min_size,
+        .newer_than = h->newer_than,
+        .older_than = h->older_than,
+        .has_owner = (h->pred_flags & SNAP_OWNER) != 0,
+        .owner = h->owner,
+    };
+    opts->prune = opts->ignore = opts->include = (struct filter_list){ 0 };
+    stat_follow = (h->flags & SNAP_FOLLOW) != 0;
+
+    uint64_t off = h->filters_off;
+    for (uint32_t i = 0; i < h->filter_count; i++) {
+        if (off >= h->strings_size) return -1;
+        const char *s = snap_string(h, off);
+        int rc;
+        switch (s[0]) {
+            case 'p': rc = add_filter(&opts->prune, s + 1, 0); break;
+            case 'i': rc = add_filter(&opts->ignore, s + 1, 0); break;
+            case 'I': rc = add_filter(&opts->ignore, s + 1, 1); break;
+            case 'n': rc = add_filter(&opts->include, s + 1, 0); break;
+            case 'N': rc = add_filter(&opts->include, s + 1, 1); break;
+            default: rc = -1;
+        }
+        if (rc == -1) return -1;
+        off += strlen(s) + 1;
+    }
+    return 0;
+}
+
+// Returns 0 if nothing changed, 1 if something did, -1 on error.
+int diff_snapshot(const char *file, const char *path, const struct ls_options *ls_opts) {
+    size_t map_size;
+    const struct snap_header *h = map_snapshot(file, &map_size);
+    if (!h) return -1;
+
+    struct diff_state ds = {
+        .h = h,
+        .recs = (const void *)((const char *)h + h->records_offset),
+        .snap_root_len = h->strings_size ? strlen(snap_string(h, 0)) : 0,
+        .root = path,
+        .root_len = strlen(path),
+    };
+
+    // Walk the way the snapshot was taken, selecting the same entries.
+    // An unsorted (-U) snapshot is put in order first.
+    struct ls_options opts = *ls_opts;
+    opts.recursive_flag = (h->flags & SNAP_RECURSIVE) != 0;
+    opts.unsorted = 0;
+    if (snap_load_selection(h, &opts) == -1) {
+        fprintf(stderr, "%s: not a valid snapshot (version %u)\n", file, SNAP_VERSION);
+        free_filters(&opts.prune);
+        free_filters(&opts.ignore);
+        free_filters(&opts.include);
+        munmap((void *)h, map_size);
+        return -1;
+    }
+    if (!(h->flags & SNAP_SORTED)) {
+        ds.order = malloc((h->record_count ? h->record_count : 1) * sizeof(*ds.order));
+        if (!ds.order) { perror("malloc"); munmap((void *)h, map_size); return -1; }
+        for (uint64_t i = 0; i < h->record_count; i++) ds.order[i] = i;
+        sort_state = &ds;
+        qsort(ds.order, h->record_count, sizeof(*ds.order), compare_snap_records);
+    }
+
+    walk_tree(path, &opts, 0, diff_entry, &ds);
+    for (const struct snap_record *r; (r = diff_peek(&ds)) != NULL; ds.next++)
+        diff_removed(&ds, r);
+
+    out_flush(&out);
+    fprintf(stderr, "%ld added, %ld removed, %ld modified\n", ds.added, ds.removed, ds.modified);
+    free(ds.order);
+    free_filters(&opts.prune);
+    free_filters(&opts.ignore);
+    free_filters(&opts.include);
+    munmap((void *)h, map_size);
+    return ds.added || ds.removed || ds.modified;
+}
+
+// ---------------- DIRECTORY CACHE -----------------
+// --cache keeps each directory's full table (every name in directory
+// order, with complete metadata) in $XDG_CACHE_HOME/ls-v1.7.0, in the
+// snapshot layout. A cache file is used only while the directory's dev,
+// inode, mtime and ctime are unchanged, so a hit costs one stat and one
+// mmap, and the sort unless -U.
+// Changes to a file that leave its directory untouched (rewriting its
+// contents, chmod) are not seen until the directory itself changes.
+int64_t timespec_ns(struct timespec ts) {
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int cache_file_path(const struct stat *dir, char *buf, size_t size) {
+    const char *base = getenv("XDG_CACHE_HOME");
+    char fallback[512];
+    if (!base || base[0] != '/') {
+        const char *home = getenv("HOME");
+        if (!home) return -1;
+        snprintf(fallback, sizeof(fallback), "%s/.cache", home);
+        base = fallback;
+    }
+    char dir_path[1024];
+    snprintf(dir_path, sizeof(dir_path), "%s/ls-v1.7.0", base);
+    mkdir(base, 0700);
+    if (mkdir(dir_path, 0700) == -1 && errno != EEXIST) return -1;
+
+    int n = snprintf(buf, size, "%s/%llx-%llx", dir_path,
+                     (unsigned long long)dir->st_dev, (unsigned long long)dir->st_ino);
+    return n < 0 || (size_t)n >= size ? -1 : 0;
+}
+
+// Loads the cached table into t if the file matches the directory.
+// Returns -1 (t left empty) otherwise.
+int cache_load(const char *file, const struct stat *dir, struct entry_table *t) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    struct stat st;
+    size_t size = 0;
+    const struct snap_header *h = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(*h)) {
+        size = st.st_size;
+        h = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (h == MAP_FAILED) return -1;
+
+    int status = -1;
+    if (!snap_header_valid(h, size) || h->dir_dev != (uint64_t)dir->st_dev || h->dir_ino != (uint64_t)dir->st_ino ||
+        h->dir_mtime_ns != timespec_ns(dir->st_mtim) ||
+        h->dir_ctime_ns != timespec_ns(dir->st_ctim))
+        goto done;
+
+    const struct snap_record *recs = (const void *)((const char *)h + h->records_offset);
+    for (uint64_t i = 0; i < h->record_count; i++) {
+        const char *name = snap_string(h, recs[i].name_off);
+        struct stat st;
+        snap_to_stat(&recs[i], &st);
+        st.st_dev = dir->st_dev;
+        int row = table_add(t, name, strlen(name), IFTODT(st.st_mode));
+        if (row == -1 || row_set_stat(t, row, &st, STATX_BASIC_STATS) == -1 ||
+            snap_set_target(h, &recs[i], t, row) == -1) {
+            table_free(t);
+            goto done;
+        }
+    }
+    t->saved = 1;
+    status = 0;
+
+done:
+    munmap((void *)h, size);
+    return status;
+}
+
+// Written to a temporary name and renamed, so readers never see a
+// partial file.
+void cache_store(const char *file, const struct stat *dir, const struct entry_table *t) {
+    int n = t->count;
+    size_t strings = t->targets_len;
+    for (int i = 0; i < n; i++) strings += t->name_len[i] + 1;
+
+    size_t records_size = (size_t)n * sizeof(struct snap_record);
+    size_t size = sizeof(struct snap_header) + records_size + strings;
+    char *buf = calloc(1, size);
+    if (!buf) return;
+
+    struct snap_header *h = (struct snap_header *)buf;
+    memcpy(h->magic, SNAP_MAGIC, sizeof(h->magic));
+    h->version = SNAP_VERSION;
+    h->byte_order = SNAP_BYTE_ORDER;
+    h->record_size = sizeof(struct snap_record);
+    h->flags = 0;
+    h->record_count = n;
+    h->records_offset = sizeof(*h);
+    h->strings_offset = sizeof(*h) + records_size;
+    h->strings_size = strings;
+    h->dir_dev = dir->st_dev;
+    h->dir_ino = dir->st_ino;
+    h->dir_mtime_ns = timespec_ns(dir->st_mtim);
+    h->dir_ctime_ns = timespec_ns(dir->st_ctim);
+
+    // Names, then the targets arena as it is.
+    struct snap_record *recs = (struct snap_record *)(buf + h->records_offset);
+    char *str = buf + h->strings_offset;
+    uint64_t off = 0, targets = strings - t->targets_len;
+    if (t->targets_len) memcpy(str + targets, t->targets, t->targets_len);
+    for (int i = 0; i < n; i++) {
+        size_t len = t->name_len[i] + 1;
+        memcpy(str + off, entry_name(t, i), len);
+        recs[i] = (struct snap_record){
+            .ino = t->ino[i], .dev = t->dev[i], .size = t->size[i],
+            .blocks = t->blocks[i], .atime = t->atime[i], .mtime = t->mtime[i],
+            .ctime = t->ctime[i], .mode = t->mode[i], .nlink = t->nlink[i],
+            .uid = t->uid[i], .gid = t->gid[i], .name_off = off, .dir_off = 0,
+            .target_off = t->flags[i] & ENTRY_TARGET ? targets + t->target_off[i] : SNAP_NO_STRING,
+            .flags = t->flags[i] & ENTRY_DANGLING ? SNAP_DANGLING : 0,
+        };
+        off += len;
+    }
+
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd != -1) {
+        int ok = write(fd, buf, size) == (ssize_t)size;
+        close(fd);
+        if (!ok || rename(tmp, file) == -1) unlink(tmp);
+    }
+    free(buf);
+}
+
+// Every entry of a directory, in directory order; with_stats fetches
+// complete metadata and symlink targets, as the cache files store them.
+int read_full_dir(const char *path, int with_stats, struct entry_table *t) {
+    DIR *d = opendir(path);
+    if (!d) { perror("opendir"); return -1; }
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        int row = table_add(t, entry->d_name, strlen(entry->d_name), entry->d_type);
+        if (row == -1) break;
+        if (with_stats && stat_row_at(dirfd(d), entry->d_name, t, row, STATX_BASIC_STATS) == -1)
+            table_pop(t);
+    }
+    closedir(d);
+    if (with_stats) {
+        static const struct ls_options link_opts = { .long_format = 1, .color = 1 };
+        fetch_links(path, t, STATX_BASIC_STATS, &link_opts);
+    }
+    return 0;
+}
+
+// In-memory counterpart used by --serve: the names and types of the most
+// recently used directories, checked against the directory's identity
+// like the files above. Unlike the opt-in --cache files it holds no
+// metadata, which can change without the directory changing; every
+// request stats the rows it shows.
+#define TABLE_CACHE_SLOTS 64
+
+struct cached_table {
+    dev_t dev;
+    ino_t ino;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    struct entry_table table;    // table.names == NULL: free slot
+    unsigned long last_used;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    int enabled;
+    unsigned long clock;
+    struct cached_table slots[TABLE_CACHE_SLOTS];
+} table_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+int table_cache_enabled(void) {
+    return table_cache.enabled;
+}
+
+int same_dir(const struct cached_table *t, const struct stat *dir) {
+    return t->table.names && t->dev == dir->st_dev && t->ino == dir->st_ino &&
+           t->mtime_ns == timespec_ns(dir->st_mtim) && t->ctime_ns == timespec_ns(dir->st_ctim);
+}
+
+// Copies are cheap: one memcpy-like pass per column plus the name arena.
+int table_cache_get(const struct stat *dir, struct entry_table *t) {
+    int status = -1;
+    pthread_mutex_lock(&table_cache.lock);
+    for (int i = 0; i < TABLE_CACHE_SLOTS; i++) {
+        struct cached_table *c = &table_cache.slots[i];
+        if (!same_dir(c, dir)) continue;
+        c->last_used = ++table_cache.clock;
+        status = table_copy(&c->table, NULL, c->table.count, t);
+        break;
+    }
+    pthread_mutex_unlock(&table_cache.lock);
+    return status;
+}
+
+// Drops the metadata of every row, keeping names and types.
+void table_strip(struct entry_table *t) {
+    struct column cols[TABLE_COLUMNS];
+    table_columns(t, cols);
+    for (int i = 0; i < t->count; i++) {
+        if (t->d_type[i] == DT_UNKNOWN && (t->stat_mask[i] & STATX_TYPE))
+            t->d_type[i] = IFTODT(t->mode[i]);
+        t->flags[i] = 0;
+        t->stat_mask[i] = 0;
+    }
+    for (int c = TABLE_BASE_COLUMNS; c < TABLE_COLUMNS; c++) {
+        free(*cols[c].data);
+        *cols[c].data = NULL;
+    }
+    free(t->targets);
+    t->targets = NULL;
+    t->targets_len = 0;
+    t->saved = 0;
+}
+
+void table_cache_put(const struct stat *dir, const struct entry_table *t) {
+    struct entry_table copy;
+    if (table_copy(t, NULL, t->count, &copy) == -1) return;
+    table_strip(&copy);
+
+    pthread_mutex_lock(&table_cache.lock);
+    struct cached_table *victim = &table_cache.slots[0];
+    for (int i = 0; i < TABLE_CACHE_SLOTS; i++) {
+        struct cached_table *c = &table_cache.slots[i];
+        if (!c->table.names || (c->dev == dir->st_dev && c->ino == dir->st_ino)) { victim = c; break; }
+        if (c->last_used < victim->last_used) victim = c;
+    }
+    struct entry_table old = victim->table;
+    *victim = (struct cached_table){
+        .dev = dir->st_dev, .ino = dir->st_ino,
+        .mtime_ns = timespec_ns(dir->st_mtim), .ctime_ns = timespec_ns(dir->st_ctim),
+        .table = copy, .last_used = ++table_cache.clock,
+    };
+    pthread_mutex_unlock(&table_cache.lock);
+
+    table_free(&old);
+}
+
+// Full table of a directory from memory, the cache file or the
+// directory itself, in that order; refills the faster layers on a miss.
+// Rows from memory or a names-only read carry no metadata yet.
+int load_full_table(const char *path, const struct stat *dir, int use_disk, struct entry_table *t) {
+    if (table_cache.enabled && table_cache_get(dir, t) == 0)
+        return 0;
+
+    char file[1024];
+    int loaded = 0;
+    if (use_disk && cache_file_path(dir, file, sizeof(file)) == -1) use_disk = 0;
+    if (use_disk) loaded = cache_load(file, dir, t) == 0;
+
+    // A directory modified within the last second could change again
+    // without its timestamps moving; do not trust such a table later.
+    int settled = time(NULL) - dir->st_mtime > 1 && time(NULL) - dir->st_ctime > 1;
+    if (!loaded) {
+        if (read_full_dir(path, use_disk, t) == -1) return -1;
+        if (use_disk && settled) cache_store(file, dir, t);
+    }
+    if (table_cache.enabled && settled) table_cache_put(dir, t);
+    return 0;
+}
+
+// gather_filenames() on top of the caches: filters run on the cached
+// table exactly as they would on readdir output, compacting it in
+// place. Returns -1 (and the caller reads the directory normally) if no
+// cache can be used.
+int gather_cached(const char *path, const struct ls_options *opts, struct entry_table *t,
+                  int *count, size_t *longest) {
+    struct stat dir;
+    if (stat(path, &dir) == -1 || !S_ISDIR(dir.st_mode)) return -1;
+    // Cache files record no extended attributes; -Z and --acl read them
+    // from the tree.
+    int use_disk = opts->use_cache && !opts->show_context && !opts->show_acl;
+    if (load_full_table(path, &dir, use_disk, t) == -1) return -1;
+
+    // Rows without metadata are stat'ed relative to the directory.
+    unsigned int pmask = predicate_mask(&opts->pred);
+    int dfd = pmask ? open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : AT_FDCWD;
+    if (dfd == -1) { table_free(t); return -1; }
+    int kept = 0;
+    *count = 0;
+    *longest = 0;
+    for (int i = 0; i < t->count; i++) {
+        const char *name = entry_name(t, i);
+        size_t len = t->name_len[i];
+        int wanted = name_wanted(name, len, opts);
+        if (!wanted) continue;
+
+        int matched = wanted == NAME_SHOWN && row_matches(dfd, t, i, &opts->pred, pmask);
+        if (!matched && !(opts->recursive_flag &&
+                          (t->d_type[i] == DT_DIR || t->d_type[i] == DT_UNKNOWN))) continue;
+        if (matched) {
+            t->flags[i] |= ENTRY_MATCHED;
+            if (len > *longest) *longest = len;
+            (*count)++;
+        }
+        table_copy_row(t, i, kept++);
+    }
+    if (dfd != AT_FDCWD) close(dfd);
+    t->count = kept;
+    if (!opts->unsorted)
+        table_sort(t);
+    return 0;
+}
+
+// ---------------- OPERANDS -----------------
+// Several operands are handled like GNU ls: files first, as one group,
+// then each directory. Directories are listed concurrently by a pool
+// of workers. The operand at the head of the output order is written
+// straight to standard output; one taken up before its turn is listed
+// into a private buffer, written by whichever worker brings the head up
+// to it. Workers stop taking operands ahead of their turn while more
+// than OPERAND_BUFFER_MAX bytes of finished output wait to be written.
+struct operand_job {
+    const char *path;
+    struct outbuf buf;
+    int done;
+};
+
+struct operand_pool {
+    struct operand_job *jobs;
+    int count;
+    int next;                    // next job to hand out
+    int head;                    // first job not yet written out
+    size_t buffered;             // bytes in finished jobs after the head
+    int *wrote;                  // output so far, for separators
+    const struct ls_options *opts;
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+};
+
+// Separates consecutive non-empty chunks of output.
+void operand_separator(struct outbuf *ob, const struct ls_options *opts, int *wrote) {
+    if (*wrote) {
+        if (opts->format == FORMAT_TEXT) out_str(ob, "\n");
+        else if (opts->format == FORMAT_JSON) out_str(ob, ",");
+    }
+    *wrote = 1;
+}
+
+// Writes the finished jobs at the head of the output order. Called with
+// the lock held by the worker that owns the head; drops it while writing.
+void operand_drain(struct operand_pool *pool) {
+    struct outbuf ob = { .fd = STDOUT_FILENO };
+    while (pool->head < pool->count && pool->jobs[pool->head].done) {
+        struct operand_job *job = &pool->jobs[pool->head];
+        pthread_mutex_unlock(&pool->lock);
+        if (job->buf.len > 0) {
+            operand_separator(&ob, pool->opts, pool->wrote);
+            out_write(&ob, job->buf.buf, job->buf.len);
+            out_flush(&ob);
+        }
+        free(job->buf.buf);
+        pthread_mutex_lock(&pool->lock);
+        pool->buffered -= job->buf.len;
+        pool->head++;
+    }
+    pthread_cond_broadcast(&pool->done_cond);
+    free(ob.buf);
+}
+
+// Lists job i straight to standard output; it is the head, so nothing
+// else is writing. The separator is dropped if the listing is empty.
+void operand_stream(struct operand_pool *pool, int i) {
+    int wrote = *pool->wrote;
+    out = (struct outbuf){ .fd = STDOUT_FILENO };
+    operand_separator(&out, pool->opts, pool->wrote);
+    size_t lead = out.len;
+    list_operand(pool->jobs[i].path, pool->opts);
+    if (out.flushed == 0 && out.len == lead) {
+        out.len = 0;
+        *pool->wrote = wrote;
+    }
+    out_flush(&out);
+    free(out.buf);
+}
+
+void *operand_worker(void *arg) {
+    struct operand_pool *pool = arg;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->next < pool->count && pool->next != pool->head &&
+               pool->buffered >= OPERAND_BUFFER_MAX)
+            pthread_cond_wait(&pool->done_cond, &pool->lock);
+        int i = pool->next++;
+        int head = i == pool->head;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->count) break;
+
+        struct operand_job *job = &pool->jobs[i];
+        if (head) {
+            operand_stream(pool, i);
+        } else {
+            out = (struct outbuf){ .fd = -1 };
+            list_operand(job->path, pool->opts);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (!head) {
+            job->buf = out;
+            pool->buffered += out.len;
+        }
+        job->done = 1;
+        if (i == pool->head) operand_drain(pool);
+        else pthread_cond_broadcast(&pool->done_cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    out = (struct outbuf){ .fd = -1 };
+    return NULL;
+}
+
+// Lists the directory operands on worker threads and writes them out in
+// operand order (see above).
+int list_dirs(const char **dirs, int ndirs, const struct ls_options *opts, int *wrote) {
+    struct operand_pool pool = {
+        .jobs = calloc(ndirs ? ndirs : 1, sizeof(struct operand_job)),
+        .count = ndirs,
+        .wrote = wrote,
+        .opts = opts,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .done_cond = PTHREAD_COND_INITIALIZER,
+    };
+    if (!pool.jobs) { perror("calloc"); return -1; }
+    for (int i = 0; i < ndirs; i++) pool.jobs[i].path = dirs[i];
+
+    // The workers write to standard output themselves, after whatever
+    // this thread has buffered.
+    out_flush(&out);
+    int nworkers = thread_count(opts);
+    if (nworkers > ndirs) nworkers = ndirs;
+    pthread_t *workers = calloc(nworkers ? nworkers : 1, sizeof(*workers));
+    int started = 0;
+    for (int i = 0; workers && i < nworkers; i++)
+        if (pthread_create(&workers[i], NULL, operand_worker, &pool) == 0) started++;
+    if (started == 0) {
+        struct outbuf saved = out;   // no threads: list them here
+        operand_worker(&pool);
+        out = saved;
+    }
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+
+    free(workers);
+    free(pool.jobs);
+    return 0;
+}
+
+int list_operands(char **paths, int n, const struct ls_options *opts) {
+    int status = 0;
+    struct entry_table files = { 0 };
+    const char **dirs = calloc(n, sizeof(*dirs));
+    if (!dirs) { perror("calloc"); return -1; }
+
+    // -l shows a symlink operand itself unless -H or -L; otherwise it is
+    // followed.
+    int ndirs = 0;
+    size_t longest = 0;
+    for (int i = 0; i < n; i++) {
+        struct stat st;
+        int rc = opts->long_format && !opts->follow_operands ? lstat(paths[i], &st) : stat(paths[i], &st);
+        if (rc == -1) {
+            fprintf(stderr, "ls: cannot access '%s': %s\n", paths[i], strerror(errno));
+            status = -1;
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            dirs[ndirs++] = paths[i];
+            continue;
+        }
+        size_t len = strlen(paths[i]);
+        int row = table_add(&files, paths[i], len, IFTODT(st.st_mode));
+        if (row == -1 || row_set_stat(&files, row, &st, STATX_BASIC_STATS) == -1) {
+            status = -1;
+            break;
+        }
+        files.flags[row] = ENTRY_MATCHED;
+        if (len > longest) longest = len;
+    }
+
+    int wrote = 0;
+    if (opts->format == FORMAT_JSON) out_str(&out, "[");
+    if (files.count > 0) {
+        if (!opts->unsorted) table_sort(&files);
+        if (opts->format == FORMAT_JSON || opts->format == FORMAT_NDJSON)
+            display_json(".", &files, opts->format);
+        else
+            display_text(".", &files, longest, opts, 0);
+        wrote = out.len > 0 || out.records > 0;
+    }
+    table_free(&files);
+
+    // A lone directory operand is listed on this thread, straight to
+    // standard output, so -l on a terminal can show its first screen early.
+    if (n == 1 && ndirs == 1)
+        list_operand(dirs[0], opts);
+    else if (ndirs > 0 && list_dirs(dirs, ndirs, opts, &wrote) == -1)
+        status = -1;
+    if (opts->format == FORMAT_JSON) out_str(&out, "\n]\n");
+
+    free(dirs);
+    return status;
+}
+
+// ---------------- SERVER -----------------
+// --serve=SOCKET answers listing requests on a Unix stream socket from a
+// pool of worker threads, so one process keeps its owner-name cache and
+// the most recent directory tables warm across requests.
+//
+// A request is one line: optional flags (-a -A -l -x -1 -R -U -h -i -s
+// -Z -T --format= --max-depth= --ignore= --include= --prune= --color=),
+// then the path, which may contain spaces. The reply is "OK <length>\n" followed by <length>
+// bytes of listing, or "ERR <message>\n". A connection may carry any
+// number of requests; each worker serves one connection at a time.
+#define SERVE_QUEUE    256
+#define SERVE_LINE_MAX 4096
+
+struct conn_queue {
+    int fds[SERVE_QUEUE];
+    int head;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+    pthread_cond_t nonfull;
+};
+
+static struct conn_queue conns = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .nonempty = PTHREAD_COND_INITIALIZER,
+    .nonfull = PTHREAD_COND_INITIALIZER,
+};
+
+static volatile sig_atomic_t serve_stop;
+
+int parse_format(const char *arg, int *format);
+int parse_color(const char *arg, int *color);
+
+// Fills opts from the flags at the start of line; returns the path or
+// NULL with *err set.
+const char *parse_request(char *line, struct ls_options *opts, const char **err) {
+    char *p = line;
+    while (*p == '-') {
+        char *tok = p;
+        char *end = strchr(p, ' ');
+        if (end) { *end = '\0'; p = end + 1; } else { p += strlen(p); }
+
+        if (strcmp(tok, "--") == 0) break;
+        if (strncmp(tok, "--", 2) == 0) {
+            char *val = strchr(tok, '=');
+            if (!val) { *err = "unknown option"; return NULL; }
+            *val++ = '\0';
+            int rc = 0;
+            if (strcmp(tok, "--format") == 0) {
+                rc = parse_format(val, &opts->format);
+                if (opts->format == FORMAT_BIN) rc = -1;
+            } else if (strcmp(tok, "--max-depth") == 0) {
+                char *num_end;
+                long n = strtol(val, &num_end, 10);
+                rc = (*val == '\0' || *num_end != '\0' || n < 0) ? -1 : 0;
+                opts->max_depth = (int)n;
+            } else if (strcmp(tok, "--ignore") == 0) {
+                rc = add_filter(&opts->ignore, val, 0);
+            } else if (strcmp(tok, "--include") == 0) {
+                rc = add_filter(&opts->include, val, 0);
+            } else if (strcmp(tok, "--prune") == 0) {
+                rc = add_filter(&opts->prune, val, 0);
+            } else if (strcmp(tok, "--color") == 0) {
+                rc = parse_color(val, &opts->color);
+                if (opts->color < 0) opts->color = 0;      // a socket is never a terminal
+            } else {
+                rc = -1;
+            }
+            if (rc != 0) { *err = "invalid option"; return NULL; }
+            continue;
+        }
+        for (char *f = tok + 1; *f; f++) {
+            switch (*f) {
+                case 'a': opts->show_hidden = HIDDEN_ALL; break;
+                case 'A': opts->show_hidden = HIDDEN_ALMOST_ALL; break;
+                case 'l': opts->long_format = 1; break;
+                case 'x': opts->horizontal_flag = 1; opts->one_per_line = 0; break;
+                case '1': opts->one_per_line = 1; opts->horizontal_flag = 0; break;
+                case 'R': opts->recursive_flag = 1; break;
+                case 'U': opts->unsorted = 1; break;
+                case 'h': opts->human_sizes = 1; break;
+                case 'i': opts->show_inode = 1; break;
+                case 's': opts->show_blocks = 1; break;
+                case 'Z': opts->show_context = 1; break;
+                case 'T': opts->tree = opts->recursive_flag = 1; break;
+                default: *err = "unknown option"; return NULL;
+            }
+        }
+    }
+    if (opts->tree && opts->long_format) { *err = "-T cannot be used with -l"; return NULL; }
+    return *p ? p : ".";
+}
+
+int send_all(int fd, const char *buf, size_t n) {
+    while (n > 0) {
+        ssize_t sent = send(fd, buf, n, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += sent;
+        n -= sent;
+    }
+    return 0;
+}
+
+int serve_request(int fd, char *line) {
+    struct ls_options opts = { .max_depth = -1 };
+    const char *err = NULL;
+    const char *path = parse_request(line, &opts, &err);
+    choose_renderer(&opts);
+
+    struct stat st;
+    if (path && stat(path, &st) == -1) err = strerror(errno);
+    else if (path && !S_ISDIR(st.st_mode)) err = "not a directory";
+
+    int rc;
+    if (err) {
+        char reply[256];
+        int n = snprintf(reply, sizeof(reply), "ERR %s\n", err);
+        rc = send_all(fd, reply, n);
+    } else {
+        out.len = 0;
+        out.records = 0;
+        list_path(path, &opts);
+        char head[32];
+        int n = snprintf(head, sizeof(head), "OK %zu\n", out.len);
+        rc = send_all(fd, head, n);
+        if (rc == 0) rc = send_all(fd, out.buf, out.len);
+    }
+
+    free_filters(&opts.prune);
+    free_filters(&opts.ignore);
+    free_filters(&opts.include);
+    return rc;
+}
+
+void serve_connection(int fd) {
+    char buf[SERVE_LINE_MAX];
+    size_t used = 0;
+    for (;;) {
+        ssize_t n = read(fd, buf + used, sizeof(buf) - used);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        used += n;
+
+        char *start = buf, *nl;
+        while ((nl = memchr(start, '\n', buf + used - start)) != NULL) {
+            *nl = '\0';
+            if (nl > start && nl[-1] == '\r') nl[-1] = '\0';
+            if (serve_request(fd, start) != 0) return;
+            start = nl + 1;
+        }
+        used -= start - buf;
+        memmove(buf, start, used);
+        if (used == sizeof(buf)) {
+            send_all(fd, "ERR request too long\n", 21);
+            return;
+        }
+    }
+}
+
+void *serve_worker(void *arg) {
+    (void)arg;
+    out.fd = -1;         // replies are built in memory
+    for (;;) {
+        pthread_mutex_lock(&conns.lock);
+        while (conns.count == 0) pthread_cond_wait(&conns.nonempty, &conns.lock);
+        int fd = conns.fds[conns.head];
+        conns.head = (conns.head + 1) % SERVE_QUEUE;
+        conns.count--;
+        pthread_cond_signal(&conns.nonfull);
+        pthread_mutex_unlock(&conns.lock);
+
+        serve_connection(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+void serve_signal(int sig) {
+    (void)sig;
+    serve_stop = 1;
+}
+
+int serve(const char *socket_path, const struct ls_options *opts) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd == -1) { perror("socket"); return -1; }
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(socket_path);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(lfd, 128) == -1) {
+        perror(socket_path);
+        close(lfd);
+        return -1;
+    }
+
+    struct sigaction sa = { .sa_handler = serve_signal };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    table_cache.enabled = 1;
+    int workers = thread_count(opts);
+    for (int i = 0; i < workers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, serve_worker, NULL) != 0) { perror("pthread_create"); break; }
+        pthread_detach(tid);
+    }
+
+    while (!serve_stop) {
+        int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            break;
+        }
+        pthread_mutex_lock(&conns.lock);
+        while (conns.count == SERVE_QUEUE) pthread_cond_wait(&conns.nonfull, &conns.lock);
+        conns.fds[(conns.head + conns.count) % SERVE_QUEUE] = fd;
+        conns.count++;
+        pthread_cond_signal(&conns.nonempty);
+        pthread_mutex_unlock(&conns.lock);
+    }
+
+    close(lfd);
+    unlink(socket_path);
+    return 0;
+}
+
+// ----------------- MAIN -----------------
+enum {
+    OPT_MAX_DEPTH = 256,
+    OPT_PRUNE,
+    OPT_IGNORE,
+    OPT_INCLUDE,
+    OPT_IGNORE_REGEX,
+    OPT_INCLUDE_REGEX,
+    OPT_TYPE,
+    OPT_LARGER_THAN,
+    OPT_NEWER_THAN,
+    OPT_OLDER_THAN,
+    OPT_OWNER,
+    OPT_FORMAT,
+    OPT_READ_SNAPSHOT,
+    OPT_CACHE,
+    OPT_NO_CACHE,
+    OPT_WATCH,
+    OPT_DIFF,
+    OPT_SERVE,
+    OPT_THREADS,
+    OPT_TIMING,
+    OPT_STAT_TIMEOUT,
+    OPT_ACL,
+    OPT_COUNT,
+    OPT_SUMMARIZE,
+    OPT_LIMIT,
+    OPT_OFFSET,
+    OPT_AFTER,
+    OPT_COLOR,
+    OPT_ESTIMATE
+};
+
+static const struct option long_options[] = {
+    {"all",           no_argument,       NULL, 'a'},
+    {"almost-all",    no_argument,       NULL, 'A'},
+    {"context",       no_argument,       NULL, 'Z'},
+    {"max-depth",     required_argument, NULL, OPT_MAX_DEPTH},
+    {"prune",         required_argument, NULL, OPT_PRUNE},
+    {"ignore",        required_argument, NULL, OPT_IGNORE},
+    {"include",       required_argument, NULL, OPT_INCLUDE},
+    {"ignore-regex",  required_argument, NULL, OPT_IGNORE_REGEX},
+    {"include-regex", required_argument, NULL, OPT_INCLUDE_REGEX},
+    {"type",          required_argument, NULL, OPT_TYPE},
+    {"larger-than",   required_argument, NULL, OPT_LARGER_THAN},
+    {"newer-than",    required_argument, NULL, OPT_NEWER_THAN},
+    {"older-than",    required_argument, NULL, OPT_OLDER_THAN},
+    {"owner",         required_argument, NULL, OPT_OWNER},
+    {"format",        required_argument, NULL, OPT_FORMAT},
+    {"read-snapshot", required_argument, NULL, OPT_READ_SNAPSHOT},
+    {"cache",         no_argument,       NULL, OPT_CACHE},
+    {"no-cache",      no_argument,       NULL, OPT_NO_CACHE},
+    {"watch",         no_argument,       NULL, OPT_WATCH},
+    {"diff",          required_argument, NULL, OPT_DIFF},
+    {"serve",         required_argument, NULL, OPT_SERVE},
+    {"threads",       required_argument, NULL, OPT_THREADS},
+    {"timing",        no_argument,       NULL, OPT_TIMING},
+    {"stat-timeout",  required_argument, NULL, OPT_STAT_TIMEOUT},
+    {"acl",           no_argument,       NULL, OPT_ACL},
+    {"count",         no_argument,       NULL, OPT_COUNT},
+    {"summarize",     no_argument,       NULL, OPT_SUMMARIZE},
+    {"limit",         required_argument, NULL, OPT_LIMIT},
+    {"offset",        required_argument, NULL, OPT_OFFSET},
+    {"after",         required_argument, NULL, OPT_AFTER},
+    {"color",         optional_argument, NULL, OPT_COLOR},
+    {"estimate",      optional_argument, NULL, OPT_ESTIMATE},
+    {NULL, 0, NULL, 0}
+};
+
+// "f,d,l" -> bit (1 << DT_xxx) per listed type
+int parse_types(const char *arg, unsigned int *mask) {
+    for (const char *p = arg; *p; p++) {
+        switch (*p) {
+            case 'f': *mask |= 1u << DT_REG; break;
+            case 'd': *mask |= 1u << DT_DIR; break;
+            case 'l': *mask |= 1u << DT_LNK; break;
+            case 'b': *mask |= 1u << DT_BLK; break;
+            case 'c': *mask |= 1u << DT_CHR; break;
+            case 'p': *mask |= 1u << DT_FIFO; break;
+            case 's': *mask |= 1u << DT_SOCK; break;
+            case ',': break;
+            default: return -1;
+        }
+    }
+    return 0;
+}
+
+// "512", "10K", "3M", "1G" (powers of 1024)
+int parse_size(const char *arg, off_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (end == arg || errno) return -1;
+    switch (*end) {
+        case '\0': break;
+        case 'k': case 'K': n <<= 10; end++; break;
+        case 'm': case 'M': n <<= 20; end++; break;
+        case 'g': case 'G': n <<= 30; end++; break;
+        case 't': case 'T': n <<= 40; end++; break;
+        default: return -1;
+    }
+    if (*end != '\0') return -1;
+    *out = (off_t)n;
+    return 0;
+}
+
+// "90" seconds, or "30m", "12h", "7d", "2w"; returns now - duration
+int parse_age(const char *arg, time_t *cutoff) {
+    char *end;
+    errno = 0;
+    long long n = strtoll(arg, &end, 10);
+    if (end == arg || errno || n < 0) return -1;
+    switch (*end) {
+        case '\0': case 's': break;
+        case 'm': n *= 60; break;
+        case 'h': n *= 3600; break;
+        case 'd': n *= 86400; break;
+        case 'w': n *= 7 * 86400; break;
+        default: return -1;
+    }
+    if (*end != '\0' && end[1] != '\0') return -1;
+    *cutoff = time(NULL) - (time_t)n;
+    return 0;
+}
+
+int parse_format(const char *arg, int *format) {
+    if (strcmp(arg, "text") == 0) *format = FORMAT_TEXT;
+    else if (strcmp(arg, "json") == 0) *format = FORMAT_JSON;
+    else if (strcmp(arg, "ndjson") == 0) *format = FORMAT_NDJSON;
+    else if (strcmp(arg, "bin") == 0) *format = FORMAT_BIN;
+    else return -1;
+    return 0;
+}
+
+// --color=WHEN: 1 always, 0 never, -1 auto (decided by isatty in main)
+int parse_color(const char *arg, int *color) {
+    if (!arg || strcmp(arg, "always") == 0 || strcmp(arg, "yes") == 0) *color = 1;
+    else if (strcmp(arg, "never") == 0 || strcmp(arg, "no") == 0) *color = 0;
+    else if (strcmp(arg, "auto") == 0 || strcmp(arg, "tty") == 0) *color = -1;
+    else return -1;
+    return 0;
+}
+
+int parse_owner(const char *arg, uid_t *uid) {
+    struct passwd *pw = getpwnam(arg);
+    if (pw) { *uid = pw->pw_uid; return 0; }
+    char *end;
+    unsigned long n = strtoul(arg, &end, 10);
+    if (end == arg || *end != '\0') return -1;
+    *uid = (uid_t)n;
+    return 0;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-a|-A] [-l|-1|-x] [-h] [-i] [-s] [-Z] [-R] [-T] [-U] [-H|-L]\n"
+            "          [--max-depth=N] [--prune=PATTERN]... [--ignore=GLOB]...\n"
+            "          [--include=GLOB]... [--ignore-regex=RE]... [--include-regex=RE]...\n"
+            "          [--type=f,d,l,b,c,p,s] [--larger-than=SIZE] [--newer-than=AGE]\n"
+            "          [--older-than=AGE] [--owner=USER] [--format=text|json|ndjson|bin]\n"
+            "          [--read-snapshot=FILE] [--cache|--no-cache] [--watch]\n"
+            "          [--diff=SNAPSHOT] [--serve=SOCKET] [--threads=N] [--timing]\n"
+            "          [--stat-timeout=MS] [--acl] [--count] [--summarize]\n"
+            "          [--limit=N] [--offset=N] [--after=NAME] [--color[=WHEN]]\n"
+            "          [--estimate[=MS]]\n"
+            "          [file|dir]...\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    struct ls_options opts = { .max_depth = -1, .color = -1 };
+    const char *snapshot_file = NULL;
+    int watch = 0;
+    const char *diff_file = NULL;
+    const char *serve_socket = NULL;
+    int timing = 0;
+    int count = 0;
+    long estimate_ms = 0;
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+
+    while ((opt = getopt_long(argc, argv, "1aAhHilLRsTUxZ", long_options, NULL)) != -1) {
+        int rc = 0;
+        switch(opt) {
+            case 'a': opts.show_hidden = HIDDEN_ALL; break;
+            case 'A': opts.show_hidden = HIDDEN_ALMOST_ALL; break;
+            case 'l': opts.long_format = 1; break;
+            case 'x': opts.horizontal_flag = 1; opts.one_per_line = 0; break;
+            case '1': opts.one_per_line = 1; opts.horizontal_flag = 0; break;
+            case 'R': opts.recursive_flag = 1; break;
+            case 'U': opts.unsorted = 1; break;
+            case 'h': opts.human_sizes = 1; break;
+            case 'i': opts.show_inode = 1; break;
+            case 's': opts.show_blocks = 1; break;
+            case 'Z': opts.show_context = 1; break;
+            case 'T': opts.tree = opts.recursive_flag = 1; break;
+            case 'H': opts.follow_operands = 1; break;
+            case 'L': opts.follow_operands = stat_follow = 1; break;
+            case OPT_ACL: opts.show_acl = 1; break;
+            case OPT_MAX_DEPTH: {
+                char *end;
+                long n = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || n < 0) {
+                    fprintf(stderr, "%s: invalid --max-depth '%s'\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                opts.max_depth = (int)n;
+                break;
+            }
+            case OPT_PRUNE:         rc = add_filter(&opts.prune, optarg, 0); break;
+            case OPT_IGNORE:        rc = add_filter(&opts.ignore, optarg, 0); break;
+            case OPT_INCLUDE:       rc = add_filter(&opts.include, optarg, 0); break;
+            case OPT_IGNORE_REGEX:  rc = add_filter(&opts.ignore, optarg, 1); break;
+            case OPT_INCLUDE_REGEX: rc = add_filter(&opts.include, optarg, 1); break;
+            case OPT_TYPE:
+                rc = parse_types(optarg, &opts.pred.type_mask);
+                break;
+            case OPT_LARGER_THAN:
+                rc = parse_size(optarg, &opts.pred.min_size);
+                opts.pred.has_min_size = 1;
+                break;
+            case OPT_NEWER_THAN:
+                rc = parse_age(optarg, &opts.pred.newer_than);
+                break;
+            case OPT_OLDER_THAN:
+                rc = parse_age(optarg, &opts.pred.older_than);
+                break;
+            case OPT_OWNER:
+                rc = parse_owner(optarg, &opts.pred.owner);
+                opts.pred.has_owner = 1;
+                break;
+            case OPT_FORMAT:
+                rc = parse_format(optarg, &opts.format);
+                break;
+            case OPT_READ_SNAPSHOT:
+                snapshot_file = optarg;
+                break;
+            case OPT_CACHE:    opts.use_cache = 1; break;
+            case OPT_NO_CACHE: opts.use_cache = 0; break;
+            case OPT_WATCH:    watch = 1; break;
+            case OPT_DIFF:     diff_file = optarg; break;
+            case OPT_SERVE:    serve_socket = optarg; break;
+            case OPT_TIMING:   timing = 1; break;
+            case OPT_COUNT:    count = 1; break;
+            case OPT_SUMMARIZE: opts.summarize = 1; break;
+            case OPT_AFTER:    opts.page_after = optarg; break;
+            case OPT_COLOR:    rc = parse_color(optarg, &opts.color); break;
+            case OPT_LIMIT:
+            case OPT_OFFSET: {
+                char *end;
+                long n = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || n < 0 || n > INT_MAX / 2) {
+                    fprintf(stderr, "%s: invalid --%s '%s'\n", argv[0],
+                            opt == OPT_LIMIT ? "limit" : "offset", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                if (opt == OPT_LIMIT) opts.page_limit = n;
+                else opts.page_offset = n;
+                break;
+            }
+            case OPT_THREADS: {
+                char *end;
+                long n = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || n < 1 || n > 1024) {
+                    fprintf(stderr, "%s: invalid --threads '%s'\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                opts.threads = (int)n;
+                break;
+            }
+            case OPT_STAT_TIMEOUT: {
+                char *end;
+                long n = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || n < 0 || n > 3600000) {
+                    fprintf(stderr, "%s: invalid --stat-timeout '%s'\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                stat_timeout_ms = (int)n;
+                break;
+            }
+            case OPT_ESTIMATE: {
+                char *end;
+                long n = optarg ? strtol(optarg, &end, 10) : DEFAULT_ESTIMATE_MS;
+                if (optarg && (*optarg == '\0' || *end != '\0' || n < 1 || n > 3600000)) {
+                    fprintf(stderr, "%s: invalid --estimate '%s'\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                estimate_ms = n;
+                break;
+            }
+            default:
+                usage(argv[0]);
+        }
+        if (rc != 0) {
+            for (const struct option *o = long_options; o->name; o++)
+                if (o->val == opt && opt >= OPT_TYPE)
+                    fprintf(stderr, "%s: invalid argument '%s' for --%s\n", argv[0], optarg, o->name);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    char *default_operand[] = { "." };
+    char **operands = optind < argc ? &argv[optind] : default_operand;
+    int noperands = optind < argc ? argc - optind : 1;
+    const char *path = operands[0];
+    if (noperands > 1 && (diff_file || watch || opts.format == FORMAT_BIN)) {
+        fprintf(stderr, "%s: --diff, --watch and --format=bin take a single directory\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts.summarize && (opts.format == FORMAT_JSON || opts.format == FORMAT_BIN)) {
+        fprintf(stderr, "%s: --summarize supports text and ndjson output only\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if ((opts.page_limit || opts.page_offset || opts.page_after) &&
+        (opts.recursive_flag || opts.unsorted || opts.format == FORMAT_BIN || count || estimate_ms ||
+         watch || diff_file)) {
+        fprintf(stderr, "%s: --limit, --offset and --after page one sorted directory listing\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (opts.tree && (opts.format != FORMAT_TEXT || opts.summarize || watch || diff_file || count ||
+                      estimate_ms)) {
+        fprintf(stderr, "%s: -T supports plain text listings only\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (opts.tree && (opts.long_format || opts.show_acl)) {
+        fprintf(stderr, "%s: -T cannot be used with -l or --acl\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (diff_file && (opts.show_hidden != HIDDEN_SKIP || opts.max_depth >= 0 || stat_follow ||
+                      opts.prune.count || opts.ignore.count || opts.include.count ||
+                      predicate_mask(&opts.pred))) {
+        fprintf(stderr, "%s: --diff selects entries as the snapshot did; drop -a, -A, -L, "
+                        "--max-depth, the filters and the predicates\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts.color < 0) opts.color = isatty(STDOUT_FILENO);
+    choose_renderer(&opts);
+
+    stat_pool.target = thread_count(&opts);
+    const char *delay = getenv("LS_STAT_DELAY");
+    char *colon = delay ? strrchr(delay, ':') : NULL;
+    if (colon) {
+        stat_delay_pattern = strndup(delay, colon - delay);
+        stat_delay_ms = atoi(colon + 1);
+    }
+
+    int status = 0;
+    if (count) {
+        if (serve_socket || diff_file || watch || snapshot_file || opts.format == FORMAT_BIN) {
+            fprintf(stderr, "%s: --count cannot be used with --serve, --diff, --watch, "
+                            "--read-snapshot or --format=bin\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        status = count_operands(operands, noperands, &opts);
+    } else if (estimate_ms) {
+        if (serve_socket || diff_file || watch || snapshot_file || opts.summarize ||
+            opts.format == FORMAT_BIN) {
+            fprintf(stderr, "%s: --estimate cannot be used with --serve, --diff, --watch, "
+                            "--read-snapshot, --summarize or --format=bin\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        status = estimate_operands(operands, noperands, &opts, estimate_ms);
+    } else if (serve_socket) {
+        status = serve(serve_socket, &opts);
+    } else if (diff_file) {
+        // diff(1) exit status: 0 same, 1 different, 2 trouble
+        status = diff_snapshot(diff_file, path, &opts);
+        return status < 0 ? 2 : status;
+    } else if (watch) {
+        if (opts.format == FORMAT_JSON || opts.format == FORMAT_BIN || snapshot_file) {
+            fprintf(stderr, "%s: --watch supports text and ndjson output only\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        status = watch_dir(path, &opts);
+    } else if (opts.format == FORMAT_BIN) {
+        if (snapshot_file) {
+            fprintf(stderr, "%s: --read-snapshot cannot write --format=bin\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        status = write_snapshot(path, &opts);
+    } else if (snapshot_file) {
+        if (opts.format == FORMAT_JSON) out_str(&out, "[");
+        status = read_snapshot(snapshot_file, &opts);
+        if (opts.format == FORMAT_JSON) out_str(&out, "\n]\n");
+    } else {
+        // -1 qualifies only without the -i, -s and -Z columns, whose
+        // widths depend on every row.
+        int short_early = opts.one_per_line && !opts.show_inode && !opts.show_blocks &&
+                          !opts.show_context;
+        opts.first_screen = noperands == 1 && (opts.long_format || short_early) &&
+                            opts.format == FORMAT_TEXT && !opts.unsorted && !opts.recursive_flag &&
+                            isatty(STDOUT_FILENO);
+        status = list_operands(operands, noperands, &opts);
+    }
+    out_flush(&out);
+
+    if (timing) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (time_first_byte.tv_sec == 0) time_first_byte = now;
+        fprintf(stderr, "time to first byte: %.3f ms, total: %.3f ms\n",
+                elapsed_ms(&time_start, &time_first_byte), elapsed_ms(&time_start, &now));
+        long rows = table_rows_seen;
+        if (rows > 0)
+            fprintf(stderr, "entry tables: %ld entries, %.1f bytes each in use (struct stat + pointer: %zu)\n",
+                    rows, (double)table_bytes_seen / rows, sizeof(struct stat) + sizeof(char *));
+    }
+
+    free_filters(&opts.prune);
+    free_filters(&opts.ignore);
+    free_filters(&opts.include);
+    return status == 0 ? 0 : EXIT_FAILURE;
+}
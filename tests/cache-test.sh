@@ -0,0 +1,138 @@
+#!/bin/sh
+# Invalidation of the --cache directory cache, run by `make cache-test`:
+#
+#     tests/cache-test.sh BIN
+#
+# Each check lets the directory settle (a table is only stored once the
+# directory is more than a second old), lists it with --cache so the
+# table is saved, changes the directory, and expects --cache to show the
+# change exactly as --no-cache does. A hit must keep directory order
+# under -U, and a truncated or damaged cache file must be ignored. The
+# last checks pin down the documented limit: a file rewritten in place
+# leaves its directory untouched, so --cache keeps showing the old
+# metadata until the directory itself changes, while --no-cache sees it
+# at once.
+
+BIN=$1
+if [ ! -x "$BIN" ]; then
+    echo "usage: $0 BIN" >&2
+    exit 2
+fi
+
+WORK=$(mktemp -d) || exit 2
+trap 'rm -rf "$WORK"' EXIT
+XDG_CACHE_HOME=$WORK/cache
+export XDG_CACHE_HOME
+
+# ---------------- FIXTURES -----------------
+DIR=$WORK/dir
+mkdir "$DIR" || exit 2
+for name in alpha beta gamma .hidden; do
+    echo "$name" > "$DIR/$name"
+done
+mkdir "$DIR/sub"
+
+# ---------------- CHECKS -----------------
+failed=0
+
+# ls ARGS...: the listing, with the name of the work directory removed.
+ls_dir() {
+    "$BIN" "$@" "$DIR" 2> "$WORK/err" | sed "s|$WORK/||g"
+}
+
+# settle: waits out the settle window and saves the directory's table.
+settle() {
+    sleep 2
+    ls_dir --cache -a -1 > /dev/null
+    if [ -z "$(ls "$XDG_CACHE_HOME/ls-v1.7.0" 2> /dev/null)" ]; then
+        echo "FAIL no cache file was written for a settled directory"
+        failed=1
+    fi
+}
+
+# same WHAT ARGS...: --cache must list what --no-cache lists.
+same() {
+    what=$1
+    shift
+    ls_dir --no-cache "$@" > "$WORK/want"
+    ls_dir --cache "$@" > "$WORK/got"
+    if cmp -s "$WORK/want" "$WORK/got"; then
+        echo "ok   $what: ls --cache $* matches --no-cache"
+    else
+        echo "FAIL $what: ls --cache $* differs from --no-cache"
+        diff "$WORK/want" "$WORK/got"
+        failed=1
+    fi
+}
+
+# differ WHAT ARGS...: --cache must still show the saved table.
+differ() {
+    what=$1
+    shift
+    ls_dir --no-cache "$@" > "$WORK/want"
+    ls_dir --cache "$@" > "$WORK/got"
+    if cmp -s "$WORK/want" "$WORK/got"; then
+        echo "FAIL $what: ls --cache $* saw a change its directory does not record"
+        failed=1
+    else
+        echo "ok   $what: ls --cache $* shows the saved table, --no-cache the change"
+    fi
+}
+
+settle
+same "hit" -a -l
+same "hit in directory order" -a -U -1
+same "hit in directory order" -U -l
+
+# A damaged cache file is ignored, and replaced, rather than trusted.
+# corrupt HOW: damages the saved table, then expects a correct listing.
+corrupt() {
+    settle
+    file=$(ls "$XDG_CACHE_HOME/ls-v1.7.0"/* | head -n 1)
+    size=$(wc -c < "$file")
+    case $1 in
+        truncated)
+            head -c $((size / 2)) "$file" > "$file.tmp" && mv "$file.tmp" "$file" ;;
+        unterminated)
+            # The last byte is the NUL ending the string table.
+            printf 'x' | dd of="$file" bs=1 seek=$((size - 1)) conv=notrunc 2> /dev/null ;;
+    esac
+    same "$1 cache file" -a -l
+}
+corrupt truncated
+corrupt unterminated
+
+settle
+echo delta > "$DIR/delta"
+same "entry added" -a -1
+same "entry added" -l
+
+settle
+rm "$DIR/beta"
+same "entry removed" -a -1
+same "entry removed" -l
+
+settle
+mv "$DIR/gamma" "$DIR/omega"
+same "entry renamed" -a -1
+same "entry renamed" -l
+
+settle
+rmdir "$DIR/sub"
+echo sub > "$DIR/sub"
+same "directory replaced by a file" -a -l
+
+# In-place changes are the documented limit, and --no-cache bypasses
+# the saved table.
+settle
+echo "grown in place" >> "$DIR/alpha"
+chmod 600 "$DIR/delta"
+differ "file changed in place" -l
+touch "$DIR/new"
+same "directory changed after an in-place change" -a -l
+
+if [ $failed -ne 0 ]; then
+    echo "cache-test: cached listings went stale" >&2
+    exit 1
+fi
+echo "cache-test: cache invalidated correctly"
@@ -0,0 +1,79 @@
+#!/bin/sh
+# Accuracy of --estimate, run by `make estimate-test`:
+#
+#     tests/estimate-test.sh BIN MKTREE
+#
+# Builds trees with mktree, whose report gives the true totals, and
+# checks what ls --estimate says about them. A tree read completely
+# within the budget must be reported exactly; otherwise every estimate
+# (entries, bytes and each depth) must lie within three times its 95%
+# margin of the truth. LS_ESTIMATE_SEED fixes the probes, but how many
+# fit in the budget depends on the machine.
+
+BIN=$1
+MKTREE=$2
+if [ ! -x "$BIN" ] || [ ! -x "$MKTREE" ]; then
+    echo "usage: $0 BIN MKTREE" >&2
+    exit 2
+fi
+
+WORK=$(mktemp -d) || exit 2
+trap 'rm -rf "$WORK"' EXIT
+
+# ---------------- FIXTURES -----------------
+# small: read completely in any budget; wide: ~18000 entries over ~1600
+# directories of uneven fan-out, more than a short budget reads.
+"$MKTREE" -d 3 -f 3 -n 10 -s 2 "$WORK/small" > "$WORK/small.txt" || exit 2
+"$MKTREE" -d 5 -f 4 -n 10 -s 5 "$WORK/wide" > "$WORK/wide.txt" || exit 2
+
+# ---------------- CHECKS -----------------
+failed=0
+
+# check TREE SEED BUDGET_MS
+check() {
+    if ! LS_ESTIMATE_SEED=$2 "$BIN" --estimate="$3" "$WORK/$1" > "$WORK/est" 2> "$WORK/err"; then
+        echo "FAIL $1 seed $2: ls exited with an error"
+        cat "$WORK/err"
+        failed=1
+        return
+    fi
+    # "  entries  V ± M" and "  depth K  V ± M" against mktree's
+    # "dirs N", "files N", "links N", "bytes N" and "depth K N".
+    awk -v truth="$WORK/$1.txt" -v run="$1 seed $2 --estimate=$3" '
+        BEGIN {
+            while ((getline line < truth) > 0) {
+                split(line, f, " ")
+                if (f[1] == "depth") want["depth " f[2]] = f[3]
+                else want[f[1]] = f[2]
+            }
+            want["entries"] = want["dirs"] + want["files"] + want["links"]
+            delete want["dirs"]; delete want["files"]; delete want["links"]
+        }
+        NR == 1 { exact = $2 == "exact,"; head = $0; next }
+        {
+            key = NF == 5 ? $1 " " $2 : $1
+            v = $(NF - 2); m = $NF
+            seen[key] = 1
+            if (!(key in want)) { bad = bad "\n  unexpected " key; next }
+            d = v - want[key]; if (d < 0) d = -d
+            if (exact ? d != 0 : (m == "?" || d > 3 * m + 1))
+                bad = bad "\n  " key ": " v " ± " m ", true " want[key]
+        }
+        END {
+            for (key in want) if (!(key in seen)) bad = bad "\n  missing " key
+            if (bad != "") { print "FAIL " run " (" head ")" bad; exit 1 }
+            print "ok   " run " (" head ")"
+        }' "$WORK/est" || failed=1
+}
+
+check small 1 5000
+for seed in 1 2 3 4 5; do
+    check wide "$seed" 20
+done
+check wide 6 60000
+
+if [ $failed -ne 0 ]; then
+    echo "estimate-test: estimates outside their margins" >&2
+    exit 1
+fi
+echo "estimate-test: all estimates within their margins"
@@ -0,0 +1,70 @@
+#!/bin/sh
+# Names in JSON output, run by `make json-test`:
+#
+#     tests/json-test.sh BIN
+#
+# Names are bytes. A name that is valid UTF-8 is written as it is; one
+# that is not gets U+FFFD for each bad byte in "name" and its raw bytes,
+# in hex, in "name_bytes", so two names that differ only in invalid
+# bytes, or in a bad byte and the character it would stand for, stay
+# distinct.
+
+BIN=$1
+if [ ! -x "$BIN" ]; then
+    echo "usage: $0 BIN" >&2
+    exit 2
+fi
+
+WORK=$(mktemp -d) || exit 2
+trap 'rm -rf "$WORK"' EXIT
+
+# ---------------- FIXTURES -----------------
+DIR=$WORK/dir
+mkdir "$DIR" || exit 2
+touch "$DIR/$(printf 'a\377')"      # invalid: a lone 0xff
+touch "$DIR/$(printf 'a\303\277')"  # valid: U+00FF
+touch "$DIR/$(printf 'a\376')"      # invalid: a lone 0xfe
+touch "$DIR/$(printf 'tab\tquote"')"
+
+# ---------------- CHECKS -----------------
+failed=0
+"$BIN" --format=ndjson "$DIR" > "$WORK/out" 2> "$WORK/err" || {
+    echo "FAIL ls --format=ndjson exited with an error"
+    cat "$WORK/err"
+    failed=1
+}
+
+# expect WHAT TEXT: one line of the output must contain TEXT.
+expect() {
+    if grep -qF "$2" "$WORK/out"; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: no line has $2"
+        failed=1
+    fi
+}
+
+expect "valid UTF-8 written as is" "$(printf '"name":"a\303\277","type"')"
+expect "invalid byte 0xff kept in name_bytes" '"name":"a\ufffd","name_bytes":"61ff"'
+expect "invalid byte 0xfe kept in name_bytes" '"name":"a\ufffd","name_bytes":"61fe"'
+expect "control characters and quotes escaped" '"name":"tab\tquote\"","type"'
+
+if [ "$(grep -c '_bytes' "$WORK/out")" -eq 2 ]; then
+    echo "ok   name_bytes only for invalid names"
+else
+    echo "FAIL name_bytes written for a valid name"
+    failed=1
+fi
+
+if LC_ALL=C grep -q "$(printf '[\376\377]')" "$WORK/out"; then
+    echo "FAIL a raw invalid byte reached the output"
+    failed=1
+else
+    echo "ok   no raw invalid bytes in the output"
+fi
+
+if [ $failed -ne 0 ]; then
+    echo "json-test: names were not written losslessly" >&2
+    exit 1
+fi
+echo "json-test: names written losslessly"
@@ -0,0 +1,80 @@
+// lsclient: sends one request to an `ls --serve` socket and writes the
+// listing to stdout, for the serve test.
+//
+//     lsclient SOCKET REQUEST
+//
+// REQUEST is sent as one line. On "OK <length>" the <length> bytes that
+// follow are written out and the exit status is 0; on "ERR <message>"
+// the message goes to stderr and the status is 1. Anything else, or a
+// reply cut short, is status 2.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Reads one byte at a time up to and including '\n'.
+static int read_line(int fd, char *buf, size_t size) {
+    size_t n = 0;
+    while (n + 1 < size) {
+        if (read(fd, buf + n, 1) != 1) return -1;
+        if (buf[n++] == '\n') break;
+    }
+    buf[n] = '\0';
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s SOCKET REQUEST\n", argv[0]);
+        return 2;
+    }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", argv[1]);
+        return 2;
+    }
+    strcpy(addr.sun_path, argv[1]);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror(argv[1]);
+        return 2;
+    }
+    size_t len = strlen(argv[2]);
+    if (write(fd, argv[2], len) != (ssize_t)len || write(fd, "\n", 1) != 1) {
+        perror("write");
+        return 2;
+    }
+
+    char head[256];
+    if (read_line(fd, head, sizeof(head)) == -1) {
+        fprintf(stderr, "lsclient: no reply\n");
+        return 2;
+    }
+    if (strncmp(head, "ERR ", 4) == 0) {
+        fputs(head + 4, stderr);
+        return 1;
+    }
+    char *end;
+    unsigned long long left = strtoull(head + 3, &end, 10);
+    if (strncmp(head, "OK ", 3) != 0 || *end != '\n') {
+        fprintf(stderr, "lsclient: bad reply: %s", head);
+        return 2;
+    }
+
+    char buf[65536];
+    while (left > 0) {
+        ssize_t n = read(fd, buf, left < sizeof(buf) ? left : sizeof(buf));
+        if (n <= 0) {
+            fprintf(stderr, "lsclient: reply cut short\n");
+            return 2;
+        }
+        fwrite(buf, 1, n, stdout);
+        left -= n;
+    }
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,129 @@
+// mktree: builds a synthetic directory tree for the perf and accuracy
+// tests and prints what it made, so a test can compare ls against the
+// exact numbers.
+//
+//     mktree [-d DEPTH] [-f FANOUT] [-n FILES] [-l PERCENT] [-s SEED] DIR
+//
+// DIR is created and gets FANOUT subdirectories; below it each directory
+// at depth < DEPTH gets 0..2*FANOUT of them, and every directory gets
+// 0..2*FILES entries, PERCENT of which are symlinks (one in four of those
+// dangling) and the rest sparse files of 0..64K bytes. The same SEED
+// always builds the same tree. The report has one "name value" per line:
+// dirs, files, links and bytes (apparent size of the regular files), then
+// "depth K N" for the entries directly inside directories at depth K, the
+// top directory being depth 0.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_DEPTH 64
+#define MAX_FILE_SIZE (64 * 1024)
+
+struct tree {
+    int depth;
+    int fanout;
+    int files;
+    int link_percent;
+    uint64_t rng;
+    long dirs_made;
+    long files_made;
+    long links_made;
+    long long bytes;
+    long per_depth[MAX_DEPTH + 1];
+};
+
+// xorshift64: reproducible across libcs, unlike rand().
+uint64_t next_random(struct tree *tr) {
+    tr->rng ^= tr->rng << 13;
+    tr->rng ^= tr->rng >> 7;
+    tr->rng ^= tr->rng << 17;
+    return tr->rng;
+}
+
+long random_below(struct tree *tr, long n) {
+    return n > 0 ? (long)(next_random(tr) % (uint64_t)n) : 0;
+}
+
+int make_file(const char *path, off_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd == -1) { perror(path); return -1; }
+    int rc = ftruncate(fd, size);
+    if (rc == -1) perror(path);
+    close(fd);
+    return rc;
+}
+
+// Fills the (existing) directory path, at depth depth.
+int fill_dir(struct tree *tr, const char *path, int depth) {
+    char child[4096];
+    long nfiles = random_below(tr, 2L * tr->files + 1);
+    for (long k = 0; k < nfiles; k++) {
+        if (random_below(tr, 100) < tr->link_percent) {
+            snprintf(child, sizeof(child), "%s/l%ld", path, k);
+            char target[32];
+            if (random_below(tr, 4) == 0) snprintf(target, sizeof(target), "missing%ld", k);
+            else snprintf(target, sizeof(target), "l%ld", k + 1 < nfiles ? k + 1 : 0L);
+            if (symlink(target, child) == -1) { perror(child); return -1; }
+            tr->links_made++;
+        } else {
+            snprintf(child, sizeof(child), "%s/f%ld", path, k);
+            off_t size = random_below(tr, MAX_FILE_SIZE + 1);
+            if (make_file(child, size) == -1) return -1;
+            tr->files_made++;
+            tr->bytes += size;
+        }
+    }
+
+    long ndirs = 0;
+    if (depth == 0) ndirs = tr->fanout;
+    else if (depth < tr->depth) ndirs = random_below(tr, 2L * tr->fanout + 1);
+    tr->per_depth[depth] += nfiles + ndirs;
+    for (long k = 0; k < ndirs; k++) {
+        snprintf(child, sizeof(child), "%s/d%ld", path, k);
+        if (mkdir(child, 0755) == -1) { perror(child); return -1; }
+        tr->dirs_made++;
+        if (fill_dir(tr, child, depth + 1) == -1) return -1;
+    }
+    return 0;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d DEPTH] [-f FANOUT] [-n FILES] [-l PERCENT] [-s SEED] DIR\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    struct tree tr = { .depth = 3, .fanout = 4, .files = 20, .link_percent = 10 };
+    unsigned long long seed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:f:n:l:s:")) != -1) {
+        switch (opt) {
+            case 'd': tr.depth = atoi(optarg); break;
+            case 'f': tr.fanout = atoi(optarg); break;
+            case 'n': tr.files = atoi(optarg); break;
+            case 'l': tr.link_percent = atoi(optarg); break;
+            case 's': seed = strtoull(optarg, NULL, 10); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || tr.depth < 0 || tr.depth > MAX_DEPTH || tr.fanout < 0 ||
+        tr.files < 0 || tr.link_percent < 0 || tr.link_percent > 100)
+        usage(argv[0]);
+    // xorshift never leaves zero; mixing keeps small seeds apart.
+    tr.rng = seed * 0x9E3779B97F4A7C15ull + 1;
+
+    const char *root = argv[optind];
+    if (mkdir(root, 0755) == -1) { perror(root); return EXIT_FAILURE; }
+    if (fill_dir(&tr, root, 0) == -1) return EXIT_FAILURE;
+
+    printf("dirs %ld\nfiles %ld\nlinks %ld\nbytes %lld\n",
+           tr.dirs_made, tr.files_made, tr.links_made, tr.bytes);
+    for (int d = 0; d <= tr.depth; d++) printf("depth %d %ld\n", d, tr.per_depth[d]);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,166 @@
+#!/bin/sh
+# Syscall budgets, run by `make perf-test`:
+#
+#     tests/perf-test.sh BIN SHIM MKTREE
+#
+# Each check runs BIN under the syscount.so shim on a tree built by
+# mktree and compares what it counted against a budget derived from the
+# tree's size, so a change that makes ls stat, open or write more per
+# entry fails here instead of going unnoticed. The fixtures live in a
+# temporary directory, which must be on a filesystem that reports d_type.
+
+BIN=$1
+SHIM=$2
+MKTREE=$3
+if [ ! -x "$BIN" ] || [ ! -f "$SHIM" ] || [ ! -x "$MKTREE" ]; then
+    echo "usage: $0 BIN SHIM MKTREE" >&2
+    exit 2
+fi
+case $SHIM in /*) ;; *) SHIM=$PWD/$SHIM ;; esac
+
+WORK=$(mktemp -d) || exit 2
+trap 'rm -rf "$WORK"' EXIT
+
+# ---------------- FIXTURES -----------------
+# flat: one directory of files and symlinks; tree: four levels of them.
+"$MKTREE" -d 0 -f 0 -n 500 -l 20 -s 7 "$WORK/flat" > "$WORK/flat.txt" || exit 2
+"$MKTREE" -d 3 -f 4 -n 20 -l 10 -s 11 "$WORK/tree" > "$WORK/tree.txt" || exit 2
+
+# fixture NAME KEY: a number from mktree's report.
+fixture() {
+    awk -v k="$2" '$1 == k { print $2 }' "$WORK/$1.txt"
+}
+
+FLAT_LINKS=$(fixture flat links)
+FLAT=$(( $(fixture flat files) + FLAT_LINKS ))
+TREE_DIRS=$(fixture tree dirs)
+TREE=$(( $(fixture tree files) + $(fixture tree links) + TREE_DIRS ))
+
+# ---------------- CHECKS -----------------
+failed=0
+
+# run ARGS...: runs ls under the shim; its counters are then read by
+# budget. Standard output is a file, so --color=auto means no color.
+run() {
+    rm -f "$WORK/counts"
+    SYSCOUNT_OUT="$WORK/counts" LD_PRELOAD="$SHIM" "$BIN" "$@" > "$WORK/out" 2> "$WORK/err"
+    if [ $? -ne 0 ] || [ ! -f "$WORK/counts" ]; then
+        echo "FAIL ls $*: exited with an error or was not counted"
+        cat "$WORK/err"
+        failed=1
+    fi
+    ARGS=$(echo "$*" | sed "s|$WORK/||g")
+}
+
+# budget "COUNTER..." MAX: the counters, summed, must not exceed MAX.
+budget() {
+    n=$(awk -v names=" $1 " 'index(names, " " $1 " ") { n += $2 } END { print n + 0 }' "$WORK/counts")
+    if [ "$n" -le "$2" ]; then
+        echo "ok   ls $ARGS: $1 = $n <= $2"
+    else
+        echo "FAIL ls $ARGS: $1 = $n > $2"
+        failed=1
+    fi
+}
+
+# Writes allowed for the output just produced: one per OUTBUF_SIZE
+# buffer, and one spare for the final partial one.
+writes() {
+    echo $(( $(wc -c < "$WORK/out") / 65536 + 2 ))
+}
+
+# Short listings take names and types from readdir alone; only the
+# operand is stat'ed, to tell a directory from a file.
+run "$WORK/flat"
+budget "stat statx" 1
+budget "opendir" 1
+budget "nss" 0
+budget "write" "$(writes)"
+
+run -1 -U "$WORK/flat"
+budget "stat statx" 1
+budget "write" "$(writes)"
+
+# -l: one statx per entry (plus the operand), readlink only for links,
+# and one passwd and one group lookup for a tree owned by one user.
+run -l "$WORK/flat"
+budget "stat statx" $((FLAT + 2))
+budget "readlink" "$FLAT_LINKS"
+budget "nss" 2
+budget "xattr" 0
+budget "write" "$(writes)"
+
+# Color needs the mode of every entry, and a stat through links only.
+run --color=always "$WORK/flat"
+budget "statx" "$FLAT"
+budget "stat" $((FLAT_LINKS + 1))
+budget "readlink" 0
+
+run -l --acl "$WORK/flat"
+budget "xattr" "$FLAT"
+
+# Name filters run on d_name before anything is stored: a filtered
+# listing stats nothing, and -l stats only the entries that match.
+run --include='f1*' "$WORK/flat"
+budget "stat statx" 1
+budget "nss" 0
+
+run -l --include='f1*' "$WORK/flat"
+MATCHES=$(grep -c '^[-l]' "$WORK/out")
+budget "stat statx" $((MATCHES + 2))
+budget "readlink" 0
+
+run -l --ignore='f*' "$WORK/flat"
+budget "stat statx" $((FLAT_LINKS + 2))
+budget "readlink" "$FLAT_LINKS"
+
+run --count "$WORK/flat"
+budget "stat statx" 0
+budget "opendir readdir" 0
+
+# Recursion opens each directory once and stats nothing it need not.
+run -R "$WORK/tree"
+budget "stat statx" 1
+budget "opendir" $((TREE_DIRS + 1))
+budget "write" "$(writes)"
+
+# Directories failing --include are still entered, from d_type alone.
+run -R --include='f1*' "$WORK/tree"
+budget "stat statx" 1
+budget "opendir" $((TREE_DIRS + 1))
+
+run -lR --include='f1*' "$WORK/tree"
+MATCHES=$(grep -c '^[-l]' "$WORK/out")
+budget "stat statx" $((MATCHES + 2))
+budget "opendir" $((TREE_DIRS + 1))
+
+run -T "$WORK/tree"
+budget "stat statx" 1
+budget "opendir" $((TREE_DIRS + 1))
+
+run -lR "$WORK/tree"
+budget "stat statx" $((TREE + 2))
+budget "opendir" $((TREE_DIRS + 1))
+budget "nss" 2
+
+run -R --summarize "$WORK/tree"
+budget "stat statx" $((TREE + 2))
+
+run --format=ndjson -R "$WORK/tree"
+budget "stat statx" $((TREE + 2))
+
+# --estimate reads each directory at most once however many probes pass
+# through it.
+run --estimate=60000 "$WORK/tree"
+budget "stat statx" $((TREE + 2))
+budget "opendir" $((TREE_DIRS + 2))
+
+run --count -R "$WORK/tree"
+budget "stat statx" 0
+budget "open" $((TREE_DIRS + 1))
+
+if [ $failed -ne 0 ]; then
+    echo "perf-test: syscall budget exceeded" >&2
+    exit 1
+fi
+echo "perf-test: all budgets met"
@@ -0,0 +1,109 @@
+#!/bin/sh
+# The listing server, run by `make serve-test`:
+#
+#     tests/serve-test.sh BIN CLIENT
+#
+# Starts `ls --serve` on a socket in a temporary directory, sends it
+# requests with CLIENT (tests/lsclient.c) and expects each reply to be
+# byte for byte what the command line prints for the same flags. A bad
+# request must get an error reply, and SIGTERM must stop the server
+# with status 0 and remove its socket.
+
+BIN=$1
+CLIENT=$2
+if [ ! -x "$BIN" ] || [ ! -x "$CLIENT" ]; then
+    echo "usage: $0 BIN CLIENT" >&2
+    exit 2
+fi
+
+WORK=$(mktemp -d) || exit 2
+pid=
+trap '[ -n "$pid" ] && kill "$pid" 2> /dev/null; rm -rf "$WORK"' EXIT
+
+# ---------------- FIXTURES -----------------
+DIR=$WORK/dir
+mkdir -p "$DIR/sub/deep" || exit 2
+for name in alpha beta .hidden sub/gamma sub/deep/delta; do
+    echo "$name" > "$DIR/$name"
+done
+chmod 755 "$DIR/alpha"
+ln -s alpha "$DIR/link"
+ln -s missing "$DIR/dangling"
+
+SOCK=$WORK/ls.sock
+"$BIN" --serve="$SOCK" --threads=2 2> "$WORK/server.err" &
+pid=$!
+tries=0
+while [ ! -S "$SOCK" ]; do
+    tries=$((tries + 1))
+    if [ $tries -gt 50 ]; then
+        echo "FAIL server did not create $SOCK"
+        cat "$WORK/server.err"
+        exit 1
+    fi
+    sleep 0.1
+done
+
+# ---------------- CHECKS -----------------
+failed=0
+
+# same FLAGS: the reply to "FLAGS DIR" must match `ls FLAGS DIR`.
+same() {
+    if ! "$CLIENT" "$SOCK" "$1 $DIR" > "$WORK/got" 2> "$WORK/err"; then
+        echo "FAIL '$1': no listing in reply"
+        cat "$WORK/err"
+        failed=1
+        return
+    fi
+    "$BIN" $1 "$DIR" > "$WORK/want" 2> /dev/null
+    if cmp -s "$WORK/want" "$WORK/got"; then
+        echo "ok   '$1' served as the command line lists it"
+    else
+        echo "FAIL '$1' differs from the command line"
+        diff "$WORK/want" "$WORK/got"
+        failed=1
+    fi
+}
+
+same "-1"
+same "-l"
+same "-a -l"
+same "-A -R -1"
+same "-l -h -i -s"
+same "-x"
+same "-Z -1"
+same "-T"
+same "-a -T --max-depth=1"
+same "-l --color=always"
+same "--format=json"
+same "-R --format=ndjson --ignore=*.o --prune=deep"
+same "-U -1"
+
+if "$CLIENT" "$SOCK" "-T -l $DIR" > /dev/null 2> "$WORK/err"; then
+    echo "FAIL '-T -l' accepted"
+    failed=1
+elif [ $? -eq 1 ]; then
+    echo "ok   '-T -l' refused: $(cat "$WORK/err")"
+else
+    echo "FAIL '-T -l': bad reply"
+    cat "$WORK/err"
+    failed=1
+fi
+
+kill -TERM "$pid"
+wait "$pid"
+status=$?
+pid=
+if [ $status -eq 0 ] && [ ! -e "$SOCK" ]; then
+    echo "ok   SIGTERM stopped the server and removed its socket"
+else
+    echo "FAIL server exited with status $status"
+    [ -e "$SOCK" ] && echo "FAIL socket left behind"
+    failed=1
+fi
+
+if [ $failed -ne 0 ]; then
+    echo "serve-test: served listings differ from the command line" >&2
+    exit 1
+fi
+echo "serve-test: served listings match the command line"
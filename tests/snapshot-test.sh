@@ -0,0 +1,120 @@
+#!/bin/sh
+# Snapshots, run by `make snapshot-test`:
+#
+#     tests/snapshot-test.sh BIN
+#
+# A snapshot must describe the tree as it was when it was written:
+# --read-snapshot renders it the same way however the tree has changed
+# since, link targets and dangling links included. --diff must select
+# entries as the snapshot did, from the options saved in its header. A
+# snapshot whose header points outside the file must be refused, not
+# read.
+
+BIN=$1
+if [ ! -x "$BIN" ]; then
+    echo "usage: $0 BIN" >&2
+    exit 2
+fi
+
+WORK=$(mktemp -d) || exit 2
+trap 'rm -rf "$WORK"' EXIT
+
+# ---------------- FIXTURES -----------------
+TREE=$WORK/tree
+mkdir -p "$TREE/sub/deep" || exit 2
+echo hello > "$TREE/a.txt"
+echo world > "$TREE/sub/b.txt"
+ln -s a.txt "$TREE/lnk"
+ln -s missing "$TREE/dangling"
+ln -s ../a.txt "$TREE/sub/up"
+"$BIN" --format=bin -R -a "$TREE" > "$WORK/snap" || exit 2
+
+# ---------------- CHECKS -----------------
+failed=0
+
+# render NAME ARGS...: --read-snapshot with ARGS into $WORK/NAME.
+render() {
+    name=$1
+    shift
+    if ! "$BIN" --read-snapshot="$WORK/snap" "$@" > "$WORK/$name" 2> "$WORK/err"; then
+        echo "FAIL ls --read-snapshot $*: exited with an error"
+        cat "$WORK/err"
+        failed=1
+    fi
+}
+
+render before-l -l
+render before-color -l --color=always
+render before-1 -1 --color=always
+if ! grep -q 'lnk -> a.txt' "$WORK/before-l"; then
+    echo "FAIL ls --read-snapshot -l: link target missing"
+    failed=1
+fi
+
+# Retarget and repair links, rewrite, chmod, add and remove entries.
+rm "$TREE/lnk" "$TREE/sub/b.txt"
+echo replaced > "$TREE/b.tar"
+ln -s b.tar "$TREE/lnk"
+ln -sf a.txt "$TREE/dangling"
+echo "grown in place" >> "$TREE/a.txt"
+chmod 600 "$TREE/a.txt"
+ln -sf b.tar "$TREE/sub/up"
+rmdir "$TREE/sub/deep"
+
+render after-l -l
+render after-color -l --color=always
+render after-1 -1 --color=always
+for mode in l color 1; do
+    if cmp -s "$WORK/before-$mode" "$WORK/after-$mode"; then
+        echo "ok   --read-snapshot ($mode) unchanged after the tree changed"
+    else
+        echo "FAIL --read-snapshot ($mode) changed with the tree"
+        diff "$WORK/before-$mode" "$WORK/after-$mode"
+        failed=1
+    fi
+done
+
+# --diff without options selects what the snapshot selected: hidden
+# entries, but not ignored names or anything below --max-depth.
+SEL=$WORK/sel
+mkdir -p "$SEL/sub/deep"
+touch "$SEL/a" "$SEL/.hidden" "$SEL/x.o" "$SEL/sub/b" "$SEL/sub/deep/c"
+"$BIN" --format=bin -R -a --ignore='*.o' --max-depth=1 "$SEL" > "$WORK/sel.snap" || exit 2
+touch "$SEL/.new" "$SEL/y.o" "$SEL/sub/deep/d"
+rm "$SEL/sub/b"
+"$BIN" --diff="$WORK/sel.snap" "$SEL" 2> /dev/null | sed "s|$SEL||" > "$WORK/diff"
+printf '%s\n' '+ /.new' '- /sub/b' > "$WORK/want"
+if cmp -s "$WORK/want" "$WORK/diff"; then
+    echo "ok   --diff selects entries as the snapshot did"
+else
+    echo "FAIL --diff did not use the snapshot's selection"
+    diff "$WORK/want" "$WORK/diff"
+    failed=1
+fi
+if "$BIN" --diff="$WORK/sel.snap" -A "$SEL" > /dev/null 2>&1; then
+    echo "FAIL --diff accepted a selection option of its own"
+    failed=1
+else
+    echo "ok   --diff refuses selection options of its own"
+fi
+
+# A record count whose size wraps around 2^64 to land inside the file
+# (little-endian; ceil(2^64 / sizeof(struct snap_record)) at offset 24).
+cp "$WORK/snap" "$WORK/bad"
+printf '\167\142\047\166\142\047\166\002' |
+    dd of="$WORK/bad" bs=1 seek=24 conv=notrunc 2> /dev/null
+"$BIN" --read-snapshot="$WORK/bad" -l > /dev/null 2> "$WORK/err"
+status=$?
+if [ $status -ne 0 ] && [ $status -lt 128 ] && grep -q "not a valid snapshot" "$WORK/err"; then
+    echo "ok   overflowing record count refused"
+else
+    echo "FAIL overflowing record count: exit status $status"
+    cat "$WORK/err"
+    failed=1
+fi
+
+if [ $failed -ne 0 ]; then
+    echo "snapshot-test: snapshots did not render as written" >&2
+    exit 1
+fi
+echo "snapshot-test: snapshots render as written"
@@ -0,0 +1,78 @@
+#!/bin/sh
+# The -l stat deadline, run by `make stat-timeout-test`:
+#
+#     tests/stat-timeout-test.sh BIN
+#
+# LS_STAT_DELAY makes the stat of matching names hang for 3 s. With
+# --stat-timeout=300 the listing must come back well before that, show
+# the hung entries as "?" rows, list the others normally and name the
+# hung entries on stderr.
+
+BIN=$1
+if [ ! -x "$BIN" ]; then
+    echo "usage: $0 BIN" >&2
+    exit 2
+fi
+
+WORK=$(mktemp -d) || exit 2
+trap 'rm -rf "$WORK"' EXIT
+
+# ---------------- FIXTURES -----------------
+DIR=$WORK/dir
+mkdir "$DIR" || exit 2
+for name in alpha beta bravo gamma; do
+    echo "$name" > "$DIR/$name"
+done
+
+# ---------------- CHECKS -----------------
+failed=0
+
+start=$(date +%s%N)
+LS_STAT_DELAY='b*:3000' "$BIN" -l --stat-timeout=300 "$DIR" > "$WORK/out" 2> "$WORK/err"
+status=$?
+ms=$(( ($(date +%s%N) - start) / 1000000 ))
+
+if [ "$ms" -lt 1500 ]; then
+    echo "ok   returned after ${ms} ms, before the 3000 ms delay"
+else
+    echo "FAIL took ${ms} ms; the 300 ms deadline was not kept"
+    failed=1
+fi
+
+for name in beta bravo; do
+    if grep -q "^?????????? .* $name\$" "$WORK/out"; then
+        echo "ok   $name shown as a ? row"
+    else
+        echo "FAIL $name not shown as a ? row"
+        failed=1
+    fi
+    if grep -q "$name: stat timed out" "$WORK/err"; then
+        echo "ok   $name reported on stderr"
+    else
+        echo "FAIL no warning for $name on stderr"
+        failed=1
+    fi
+done
+
+for name in alpha gamma; do
+    if grep -q "^-rw.* $name\$" "$WORK/out"; then
+        echo "ok   $name listed normally"
+    else
+        echo "FAIL $name not listed normally"
+        failed=1
+    fi
+done
+
+if [ $status -lt 128 ]; then
+    echo "ok   exited normally"
+else
+    echo "FAIL killed by signal $((status - 128))"
+    failed=1
+fi
+
+if [ $failed -ne 0 ]; then
+    echo "stat-timeout-test: the stat deadline was not kept" >&2
+    cat "$WORK/out" "$WORK/err" >&2
+    exit 1
+fi
+echo "stat-timeout-test: hung stats cut off at the deadline"